@@ -0,0 +1,209 @@
+#include <iostream>
+#include <cstring>
+#include <stdexcept>
+
+#include "ffm.h"
+
+// Micro benchmarks of the solver kernels on one user-item block, and of
+// reading and one epoch of training, swept over thread counts. Each result
+// is a JSON line on stdout, so runs from different commits can be joined
+// on (bench, threads).
+struct Option {
+    string xt_path, tr_path, te_path, tag;
+    ImpInt k = 16, reps = 5, max_threads = omp_get_max_threads();
+};
+
+string benchmark_help()
+{
+    return string(
+    "usage: benchmark [options] item_feature_file train_file test_file\n"
+    "\n"
+    "options:\n"
+    "-k <rank>: set number of rank (default 16)\n"
+    "-r <reps>: set repetitions per measurement (default 5)\n"
+    "-c <threads>: set the largest thread count of the sweep (default all cores)\n"
+    "--tag <name>: label every result, e.g. with a commit\n"
+    );
+}
+
+Option parse_option(int argc, char **argv)
+{
+    if(argc == 1)
+        throw invalid_argument(benchmark_help());
+
+    Option option;
+    int i;
+    for(i = 1; i < argc; i++)
+    {
+        const string arg = argv[i];
+        if(arg != "-k" && arg != "-r" && arg != "-c" && arg != "--tag")
+            break;
+        if(i == argc-1)
+            throw invalid_argument("need to specify a value after " + arg);
+        const char *val = argv[++i];
+        if(arg == "-k")
+            option.k = atoi(val);
+        else if(arg == "-r")
+            option.reps = atoi(val);
+        else if(arg == "-c")
+            option.max_threads = atoi(val);
+        else
+            option.tag = val;
+    }
+    if(i+3 != argc)
+        throw invalid_argument("item, train and test files not specified");
+    if(option.k <= 0 || option.reps <= 0 || option.max_threads <= 0)
+        throw invalid_argument("rank, repetitions and threads should be positive");
+    option.xt_path = argv[i];
+    option.tr_path = argv[i+1];
+    option.te_path = argv[i+2];
+    return option;
+}
+
+void bench(const string &name, const Option &option, const ImpInt nr_threads,
+        const function<void()> &call)
+{
+    vector<ImpDouble> times(option.reps);
+    for(ImpDouble &t : times)
+    {
+        const ImpDouble t0 = omp_get_wtime();
+        call();
+        t = omp_get_wtime()-t0;
+    }
+    sort(times.begin(), times.end());
+    cout << "{\"bench\":\"" << name << "\",\"tag\":\"" << option.tag << "\",\"threads\":"
+        << nr_threads << ",\"k\":" << option.k << ",\"reps\":" << option.reps
+        << ",\"min\":" << times[0] << ",\"median\":" << times[option.reps/2] << '}' << endl;
+}
+
+class ImpBench {
+public:
+    ImpBench(ImpProblem &prob, const Option &option);
+    void run_kernels(const ImpInt nr_threads);
+private:
+    ImpProblem &p;
+    const Option &option;
+};
+
+ImpBench::ImpBench(ImpProblem &prob, const Option &option): p(prob), option(option)
+{
+    srand(1);
+    p.init();
+    cout.setstate(ios::failbit);
+    p.init_va();
+    cout.clear();
+}
+
+// The kernels on block (0, fu), and on the side block (0, 0) when there is
+// one, then a whole epoch.
+void ImpBench::run_kernels(const ImpInt nr_threads)
+{
+    const ImpInt k = p.k, fu = p.fu, f12 = fu;
+    const ImpLong m = p.m, n = p.n;
+    const CSR &X = p.U->Xs[0], &XT = p.U->XTs[0];
+    const Vec &W1 = p.W[f12], &Q1 = p.Q[f12];
+    const ImpLong Dk = W1.size();
+
+    Vec C(m*k), G(Dk), S(Dk), Hv(Dk), VQTQ(Dk), QTQ(k*k);
+    const Vec &V = W1;
+    for(ImpLong j = 0; j < n; j++)
+        for(ImpInt d = 0; d < k; d++)
+            for(ImpInt e = 0; e < k; e++)
+                QTQ[d*k+e] += Q1[j*k+d]*Q1[j*k+e];
+    for(ImpLong s = 0; s < Dk/k; s++)
+        for(ImpInt d = 0; d < k; d++)
+            for(ImpInt e = 0; e < k; e++)
+                VQTQ[s*k+e] += V[s*k+d]*QTQ[d*k+e];
+
+    bench("UTX", option, nr_threads, [&] { p.UTX(X, m, W1.data(), C); });
+    bench("XTC", option, nr_threads, [&] {
+        fill(G.begin(), G.end(), 0);
+        p.XTC(XT, C, G);
+    });
+    bench("gd_cross", option, nr_threads, [&] {
+        fill(G.begin(), G.end(), 0);
+        p.gd_cross(0, f12, Q1, W1, G);
+    });
+    bench("hs_cross", option, nr_threads, [&] {
+        fill(Hv.begin(), Hv.end(), 0);
+        p.hs_cross(p.rows_of(0), V, VQTQ, Hv, Q1, X, XT, p.U->Y, false, C);
+    });
+    bench("cg", option, nr_threads, [&] {
+        fill(S.begin(), S.end(), 0);
+        p.cg(0, fu, false, S, Q1, G, p.P[f12]);
+    });
+
+    if(p.param->self_side && fu > 0)
+    {
+        const Vec &Ws = p.W[0], &Qs = p.Q[0];
+        Vec Gs(Ws.size()), Hs(Ws.size());
+        bench("gd_side", option, nr_threads, [&] {
+            fill(Gs.begin(), Gs.end(), 0);
+            p.gd_side(0, Ws, Qs, Gs);
+        });
+        bench("hs_side", option, nr_threads, [&] {
+            fill(Hs.begin(), Hs.end(), 0);
+            p.hs_side(p.rows_of(0), n, Ws, Hs, Qs, X, XT, p.nnz_u, C);
+        });
+    }
+
+    bench("validate", option, nr_threads, [&] { p.validate(); });
+    bench("epoch", option, nr_threads, [&] { p.one_epoch(); });
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        const Option option = parse_option(argc, argv);
+        cout << setprecision(6);
+
+        vector<ImpInt> sweep;
+        for(ImpInt t = 1; t < option.max_threads; t *= 2)
+            sweep.push_back(t);
+        sweep.push_back(option.max_threads);
+
+        shared_ptr<Parameter> param = make_shared<Parameter>();
+        param->k = option.k;
+        param->nr_threads = option.max_threads;
+        omp_set_num_threads(option.max_threads);
+
+        shared_ptr<ImpData> U = make_shared<ImpData>(option.tr_path);
+        shared_ptr<ImpData> V = make_shared<ImpData>(option.xt_path);
+        shared_ptr<ImpData> Ut = make_shared<ImpData>(option.te_path);
+        U->read(true, option.max_threads);
+        V->read(false, option.max_threads);
+        Ut->read(true, option.max_threads);
+        U->split_fields();
+        V->transY(U->Y);
+        V->split_fields();
+        Ut->split_fields(U->Ds);
+        if(U->f == 0 || V->f == 0)
+            throw invalid_argument("users and items need at least one field each");
+
+        cout << "{\"bench\":\"config\",\"tag\":\"" << option.tag << "\",\"m\":" << U->m
+            << ",\"n\":" << V->m << ",\"fu\":" << U->f << ",\"fv\":" << V->f
+            << ",\"nnz_x\":" << U->nnz_x << ",\"nnz_y\":" << U->Y.nnz() << '}' << endl;
+
+        // Strong scaling: the same problem, from the same initial model, at
+        // each thread count.
+        for(const ImpInt nr_threads : sweep)
+        {
+            omp_set_num_threads(nr_threads);
+            param->nr_threads = nr_threads;
+            bench("read", option, nr_threads, [&] {
+                ImpData D(option.tr_path);
+                D.read(true, nr_threads);
+            });
+            ImpProblem prob(U, Ut, V, param);
+            ImpBench kernels(prob, option);
+            kernels.run_kernels(nr_threads);
+        }
+    }
+    catch(invalid_argument &e)
+    {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
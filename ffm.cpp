@@ -1,4 +1,5 @@
 #include "ffm.h"
+#include "kernel.h"
 
 ImpDouble qrsqrt(ImpDouble x)
 {
@@ -18,50 +19,206 @@ ImpDouble sum(const Vec &v) {
     return sum;
 }
 
-void axpy(const ImpDouble *x, ImpDouble *y, const ImpLong &l, const ImpDouble &lambda) {
-    cblas_daxpy(l, lambda, x, 1, y, 1);
+ImpInt mpi_rank() {
+#ifdef USEMPI
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    return rank;
+#else
+    return 0;
+#endif
 }
 
-void scal(ImpDouble *x, const ImpLong &l, const ImpDouble &lambda) {
-    cblas_dscal(l, lambda, x, 1);
+ImpInt mpi_size() {
+#ifdef USEMPI
+    int size;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    return size;
+#else
+    return 1;
+#endif
 }
 
-void mm(const ImpDouble *a, const ImpDouble *b, ImpDouble *c,
-        const ImpLong l, const ImpLong n, const ImpInt k) {
-    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-            l, n, k, 1, a, k, b, n, 0, c, n);
+#ifdef USEMPI
+template <typename T>
+void allreduce(T *buf, const ImpLong count, MPI_Datatype type, MPI_Op op) {
+    if (mpi_size() == 1)
+        return;
+    for (ImpLong s = 0; s < count; s += INT_MAX)
+        MPI_Allreduce(MPI_IN_PLACE, buf+s, min<ImpLong>(INT_MAX, count-s), type, op, MPI_COMM_WORLD);
 }
+#define ALLREDUCE(buf, count, type, op) allreduce(buf, count, type, op)
+#else
+#define ALLREDUCE(buf, count, type, op)
+#endif
 
-void mm(const ImpDouble *a, const ImpDouble *b, ImpDouble *c,
-        const ImpLong l, const ImpLong n, const ImpInt k, const ImpDouble &beta) {
-    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-            l, n, k, 1, a, k, b, n, beta, c, n);
+void sum_all(float *buf, const ImpLong count) { ALLREDUCE(buf, count, MPI_FLOAT, MPI_SUM); }
+void sum_all(double *buf, const ImpLong count) { ALLREDUCE(buf, count, MPI_DOUBLE, MPI_SUM); }
+void sum_all(ImpLong *buf, const ImpLong count) { ALLREDUCE(buf, count, MPI_UNSIGNED_LONG, MPI_SUM); }
+void max_all(ImpLong *buf, const ImpLong count) { ALLREDUCE(buf, count, MPI_UNSIGNED_LONG, MPI_MAX); }
+void min_all(ImpLong *buf, const ImpLong count) { ALLREDUCE(buf, count, MPI_UNSIGNED_LONG, MPI_MIN); }
+
+struct ScratchStack {
+    deque<Vec> vecs, disk_vecs;
+    deque<vector<ImpDouble>> dvecs;
+    deque<vector<ImpLong>> lvecs;
+    size_t nr_vecs = 0, nr_disk_vecs = 0, nr_dvecs = 0, nr_lvecs = 0;
+};
+thread_local ScratchStack scratch;
+
+template <typename T, typename V>
+T& take(deque<T> &arrays, size_t &nr, const size_t n, const V v) {
+    if (nr == arrays.size())
+        arrays.emplace_back();
+    T &a = arrays[nr++];
+    a.assign(n, v);
+    return a;
+}
+
+Workspace::Workspace(): nr_vecs(scratch.nr_vecs), nr_disk_vecs(scratch.nr_disk_vecs),
+    nr_dvecs(scratch.nr_dvecs), nr_lvecs(scratch.nr_lvecs) {}
+
+Workspace::~Workspace() {
+    scratch.nr_vecs = nr_vecs;
+    scratch.nr_disk_vecs = nr_disk_vecs;
+    scratch.nr_dvecs = nr_dvecs;
+    scratch.nr_lvecs = nr_lvecs;
+}
+
+Vec& Workspace::vec(const size_t n, const ImpFloat v, const bool disk) {
+    if (!disk)
+        return take(scratch.vecs, scratch.nr_vecs, n, v);
+    DiskScope scope(true);
+    return take(scratch.disk_vecs, scratch.nr_disk_vecs, n, v);
+}
+
+vector<ImpDouble>& Workspace::dvec(const size_t n) {
+    return take(scratch.dvecs, scratch.nr_dvecs, n, 0.0);
+}
+
+vector<ImpLong>& Workspace::lvec(const size_t n) {
+    return take(scratch.lvecs, scratch.nr_lvecs, n, 0ul);
+}
+
+// Dense linear algebra on ImpFloat blocks, built on the kernels in kernel.h.
+// Short vectors run inline in the calling thread; whole blocks are split
+// across threads. Scaling factors are always passed in double.
+const ImpLong PAR_LEN = 1<<15;
+
+inline void axpy(const ImpFloat *x, ImpFloat *y, const ImpLong &l, const ImpDouble &lambda) {
+    if (l < PAR_LEN) {
+        axpy_k(x, y, l, lambda);
+        return;
+    }
+#pragma omp parallel for schedule(static)
+    for (ImpLong s = 0; s < l; s += PAR_LEN)
+        axpy_kernel(x+s, y+s, min(PAR_LEN, l-s), lambda);
+}
+
+void scal(ImpFloat *x, const ImpLong &l, const ImpDouble &lambda) {
+    const ImpFloat a = lambda;
+#pragma omp parallel for schedule(static) if(l >= PAR_LEN)
+    for (ImpLong i = 0; i < l; i++)
+        x[i] *= a;
+}
+
+inline ImpDouble inner(const ImpFloat *p, const ImpFloat *q, const ImpLong k)
+{
+    if (k < PAR_LEN)
+        return dot_k(p, q, k);
+    ImpDouble res = 0;
+#pragma omp parallel for schedule(static) reduction(+: res)
+    for (ImpLong s = 0; s < k; s += PAR_LEN)
+        res += dot(p+s, q+s, min(PAR_LEN, k-s));
+    return res;
+}
+
+// C = A*B + beta*C with A l-by-k and B k-by-n.
+void mm(const ImpFloat *a, const ImpFloat *b, ImpFloat *c,
+        const ImpLong l, const ImpLong n, const ImpInt k, const ImpDouble &beta = 0) {
+#pragma omp parallel for schedule(static)
+    for (ImpLong i = 0; i < l; i++) {
+        ImpFloat *ci = c+i*n;
+        if (beta == 0)
+            fill(ci, ci+n, 0);
+        else if (beta != 1)
+            for (ImpLong j = 0; j < n; j++)
+                ci[j] *= beta;
+        const ImpFloat *ai = a+i*k;
+        for (ImpInt d = 0; d < k; d++)
+            axpy_k(b+d*n, ci, n, ai[d]);
+    }
 }
 
-void mm(const ImpDouble *a, const ImpDouble *b, ImpDouble *c,
+// C = A^T*B for l-by-k A and B, summed in double per thread.
+void mm(const ImpFloat *a, const ImpFloat *b, ImpFloat *c,
         const ImpLong k, const ImpLong l) {
-    cblas_dgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
-            k, k, l, 1, a, k, b, k, 0, c, k);
+    Workspace ws;
+    vector<ImpDouble> &acc = ws.dvec(k*k);
+#pragma omp parallel
+    {
+        Workspace ws_t;
+        vector<ImpDouble> &acc_t = ws_t.dvec(k*k);
+#pragma omp for schedule(static) nowait
+        for (ImpLong i = 0; i < l; i++) {
+            const ImpFloat *ai = a+i*k, *bi = b+i*k;
+            for (ImpLong d = 0; d < k; d++)
+                axpy_k(bi, acc_t.data()+d*k, k, ai[d]);
+        }
+#pragma omp critical
+        for (ImpLong d = 0; d < k*k; d++)
+            acc[d] += acc_t[d];
+    }
+    for (ImpLong d = 0; d < k*k; d++)
+        c[d] = acc[d];
 }
 
-void mv(const ImpDouble *a, const ImpDouble *b, ImpDouble *c,
+// c = A^T*b + beta*c (trans) or A*b + beta*c for l-by-k A.
+void mv(const ImpFloat *a, const ImpFloat *b, ImpFloat *c,
         const ImpLong l, const ImpInt k, const ImpDouble &beta, bool trans) {
-    const CBLAS_TRANSPOSE CBTr= (trans)? CblasTrans: CblasNoTrans;
-    cblas_dgemv(CblasRowMajor, CBTr, l, k, 1, a, k, b, 1, beta, c, 1);
+    if (!trans) {
+#pragma omp parallel for schedule(static)
+        for (ImpLong i = 0; i < l; i++)
+            c[i] = (beta == 0)? inner(a+i*k, b, k): beta*c[i]+inner(a+i*k, b, k);
+        return;
+    }
+    Workspace ws;
+    vector<ImpDouble> &acc = ws.dvec(k);
+#pragma omp parallel
+    {
+        Workspace ws_t;
+        vector<ImpDouble> &acc_t = ws_t.dvec(k);
+#pragma omp for schedule(static) nowait
+        for (ImpLong i = 0; i < l; i++)
+            axpy_k(a+i*k, acc_t.data(), k, b[i]);
+#pragma omp critical
+        for (ImpInt d = 0; d < k; d++)
+            acc[d] += acc_t[d];
+    }
+    for (ImpInt d = 0; d < k; d++)
+        c[d] = (beta == 0)? acc[d]: beta*c[d]+acc[d];
 }
 
-const ImpInt index_vec(const ImpInt f1, const ImpInt f2, const ImpInt f) {
-    return f2 + (f-1)*f1 - f1*(f1-1)/2;
+// Only the scoring GEMM still goes through BLAS.
+void mmt(const double *a, const double *b, double *c,
+        const ImpLong l, const ImpLong n, const ImpInt k, const ImpDouble &beta) {
+    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+            l, n, k, 1, a, k, b, k, beta, c, n);
 }
 
-ImpDouble inner(const ImpDouble *p, const ImpDouble *q, const ImpInt k)
-{
-    return cblas_ddot(k, p, 1, q, 1);
+void mmt(const float *a, const float *b, float *c,
+        const ImpLong l, const ImpLong n, const ImpInt k, const ImpDouble &beta) {
+    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+            l, n, k, 1, a, k, b, k, beta, c, n);
+}
+
+const ImpInt index_vec(const ImpInt f1, const ImpInt f2, const ImpInt f) {
+    return f2 + (f-1)*f1 - f1*(f1-1)/2;
 }
 
 void row_wise_inner(const Vec &V1, const Vec &V2, const ImpLong &row,
         const ImpLong &col,const ImpDouble &alpha, Vec &vv){
-    const ImpDouble *v1p = V1.data(), *v2p = V2.data();
+    const ImpFloat *v1p = V1.data(), *v2p = V2.data();
 
     #pragma omp parallel for schedule(guided)
     for(ImpInt i = 0; i < row; i++)
@@ -71,225 +228,531 @@ void row_wise_inner(const Vec &V1, const Vec &V2, const ImpLong &row,
 void init_mat(Vec &vec, const ImpLong nr_rows, const ImpLong nr_cols) {
     default_random_engine ENGINE(rand());
     vec.resize(nr_rows*nr_cols, 0.1);
-    uniform_real_distribution<ImpDouble> dist(-0.1*qrsqrt(nr_cols), 0.1*qrsqrt(nr_cols));
+    uniform_real_distribution<ImpFloat> dist(-0.1*qrsqrt(nr_cols), 0.1*qrsqrt(nr_cols));
 
     auto gen = std::bind(dist, ENGINE);
     generate(vec.begin(), vec.end(), gen);
 }
 
-void ImpData::read(bool has_label, const ImpLong *ds) {
-    ifstream fs(file_name);
-    string line, label_block, label_str;
-    char dummy;
+inline bool is_blank(const char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
 
-    ImpLong fid, idx, y_nnz=0, x_nnz=0;
-    ImpDouble val;
+inline bool parse_uint(const char *&p, const char *end, ImpLong &v) {
+    const char *q = p;
+    v = 0;
+    while (q < end && '0' <= *q && *q <= '9')
+        v = v*10 + (*q++ - '0');
+    if (q == p)
+        return false;
+    p = q;
+    return true;
+}
 
-    while (getline(fs, line)) {
-        m++;
-        istringstream iss(line);
+// Exact for up to 15 significant digits and 22 decimals; longer tokens and
+// exponents go through strtod.
+inline bool parse_real(const char *&p, const char *end, ImpDouble &v) {
+    static const ImpDouble pow10[23] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6,
+        1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+        1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *q = p;
+    bool neg = false;
+    if (q < end && (*q == '-' || *q == '+'))
+        neg = (*q++ == '-');
+    ImpLong mant = 0;
+    ImpInt digits = 0, frac = 0;
+    const char *d0 = q;
+    while (q < end && '0' <= *q && *q <= '9') {
+        mant = mant*10 + (*q++ - '0');
+        digits += (mant > 0);
+    }
+    if (q < end && *q == '.') {
+        q++;
+        while (q < end && '0' <= *q && *q <= '9') {
+            mant = mant*10 + (*q++ - '0');
+            digits += (mant > 0);
+            frac++;
+        }
+    }
+    if (q == d0 || (q == d0+1 && *d0 == '.'))
+        return false;
+    if (digits > 15 || frac > 22 || (q < end && (*q == 'e' || *q == 'E'))) {
+        char buf[64];
+        const char *t = p;
+        size_t len = 0;
+        while (t < end && len < sizeof(buf)-1 && !is_blank(*t) && *t != '\n')
+            buf[len++] = *t++;
+        buf[len] = '\0';
+        char *stop;
+        v = strtod(buf, &stop);
+        if (stop == buf)
+            return false;
+        p += stop-buf;
+        return true;
+    }
+    v = ImpDouble(mant)/pow10[frac];
+    if (neg)
+        v = -v;
+    p = q;
+    return true;
+}
+
+// Bucket of a hashed feature: the top bits of a 64-bit mix of its index,
+// so ids that differ only in their low or high bits still spread.
+inline ImpLong hash_index(ImpLong idx, const ImpInt bits) {
+    idx ^= idx >> 33;
+    idx *= 0xff51afd7ed558ccdUL;
+    idx ^= idx >> 33;
+    idx *= 0xc4ceb9fe1a85ec53UL;
+    idx ^= idx >> 33;
+    return idx >> (64-bits);
+}
 
+struct ReadChunk {
+    vector<ImpIdx> fids, idx, labels;
+    Vec vals;
+    vector<ImpLong> nnx, nny;
+    ImpLong f = 0, n = 0;
+    bool overflow = false;
+};
+
+void parse_chunk(const char *p, const char *end, bool has_label,
+        const vector<ImpInt> &hash_bits, ReadChunk &c) {
+    const ImpLong max_idx = numeric_limits<ImpIdx>::max();
+    while (p < end) {
+        const char *eol = static_cast<const char*>(memchr(p, '\n', end-p));
+        if (eol == nullptr)
+            eol = end;
+
+        const ImpLong x_start = c.idx.size(), y_start = c.labels.size();
+        while (p < eol && is_blank(*p))
+            p++;
         if (has_label) {
-            iss >> label_block;
-            istringstream labelst(label_block);
-            while (getline(labelst, label_str, ',')) {
-                idx = stoi(label_str);
-                n = max(n, idx+1);
-                y_nnz++;
+            ImpLong idx;
+            while (p < eol && !is_blank(*p)) {
+                if (parse_uint(p, eol, idx)) {
+                    c.overflow |= (idx > max_idx);
+                    c.labels.push_back(idx);
+                    c.n = max(c.n, idx+1);
+                }
+                while (p < eol && *p != ',' && !is_blank(*p))
+                    p++;
+                if (p < eol && *p == ',')
+                    p++;
             }
         }
 
-        while (iss >> fid >> dummy >> idx >> dummy >> val) {
-            f = max(f, fid+1);
-            if (ds!= nullptr && ds[fid] <= idx)
-                continue;
-            x_nnz++;
+        ImpLong fid, idx;
+        ImpDouble val;
+        while (p < eol) {
+            while (p < eol && is_blank(*p))
+                p++;
+            if (p == eol)
+                break;
+            if (!parse_uint(p, eol, fid) || ++p >= eol
+                    || !parse_uint(p, eol, idx) || ++p >= eol
+                    || !parse_real(p, eol, val))
+                break;
+            if (fid < hash_bits.size() && hash_bits[fid] > 0)
+                idx = hash_index(idx, hash_bits[fid]);
+            c.overflow |= (fid > max_idx || idx > max_idx);
+            c.f = max(c.f, fid+1);
+            c.fids.push_back(fid);
+            c.idx.push_back(idx);
+            c.vals.push_back(val);
         }
+
+        c.nnx.push_back(c.idx.size()-x_start);
+        c.nny.push_back(c.labels.size()-y_start);
+        p = eol+1;
     }
+}
+
+// Start of the first line at or after byte size*part/nr_parts, so that the
+// parts of a file split it at line boundaries.
+const char* part_start(const ImpMap &text, const ImpInt part, const ImpInt nr_parts) {
+    const char *end = text.addr+text.size;
+    if (part == 0)
+        return text.addr;
+    if (part >= nr_parts)
+        return end;
+    const char *p = text.addr + text.size*part/nr_parts - 1;
+    p = static_cast<const char*>(memchr(p, '\n', end-p));
+    return (p == nullptr)? end: p+1;
+}
+
+void normalize(vector<ImpDouble> &popular) {
+    ImpDouble sum = 0;
+    for (auto &n : popular)
+        sum += n;
+    for (auto &n : popular)
+        n /= sum;
+}
 
-    fs.clear();
-    fs.seekg(0);
+// Reads part `part` of nr_parts of the rows; a split set is completed
+// across ranks by split_fields.
+void ImpData::read(bool has_label, ImpInt nr_threads, ImpInt part, ImpInt nr_parts) {
+    this->nr_parts = nr_parts;
+    ImpMap text(file_name);
+    if (text.addr == nullptr)
+        return;
+    parse(part_start(text, part, nr_parts), part_start(text, part+1, nr_parts), has_label, nr_threads);
+}
 
-    nnz_x = x_nnz;
-    N.resize(x_nnz);
+void ImpData::parse(const char *begin, const char *end, bool has_label, ImpInt nr_threads) {
+    const ImpLong size = end-begin;
+    const ImpInt nr_chunks = max<ImpLong>(1, min<ImpLong>(4*nr_threads, size>>16));
 
-    X.resize(m+1);
-    Y.resize(m+1);
+    vector<const char*> bounds(nr_chunks+1, end);
+    bounds[0] = begin;
+    for (ImpInt c = 1; c < nr_chunks; c++) {
+        const char *p = begin + size*c/nr_chunks;
+        p = static_cast<const char*>(memchr(p, '\n', end-p));
+        bounds[c] = (p == nullptr)? end: max(p+1, bounds[c-1]);
+    }
 
-    if (has_label) {
-        nnz_y = y_nnz;
-        M.resize(y_nnz);
-        popular.resize(n);
-        fill(popular.begin(), popular.end(), 0);
+    vector<ReadChunk> chunks(nr_chunks);
+#pragma omp parallel for schedule(dynamic) num_threads(nr_threads)
+    for (ImpInt c = 0; c < nr_chunks; c++)
+        parse_chunk(bounds[c], bounds[c+1], has_label, hash_bits, chunks[c]);
+
+    vector<ImpLong> row_base(nr_chunks+1, 0), x_base(nr_chunks+1, 0), y_base(nr_chunks+1, 0);
+    for (ImpInt c = 0; c < nr_chunks; c++) {
+        if (chunks[c].overflow)
+            throw invalid_argument("index does not fit in 32 bits in " + file_name);
+        row_base[c+1] = row_base[c] + chunks[c].nnx.size();
+        x_base[c+1] = x_base[c] + chunks[c].idx.size();
+        y_base[c+1] = y_base[c] + chunks[c].labels.size();
+        f = max(f, chunks[c].f);
+        n = max(n, chunks[c].n);
     }
 
+    m = row_base[nr_chunks];
+    nnz_x = x_base[nr_chunks];
+    nnz_y = y_base[nr_chunks];
+    X.resize(m, nnz_x);
+    Y.resize(m, nnz_y);
+    fids.resize(nnz_x);
     nnx.resize(m);
     nny.resize(m);
-    fill(nnx.begin(), nnx.end(), 0);
-    fill(nny.begin(), nny.end(), 0);
-
-    ImpLong nnz_i=0, nnz_j=0, i=0;
 
-    while (getline(fs, line)) {
-        istringstream iss(line);
-
-        if (has_label) {
-            iss >> label_block;
-            istringstream labelst(label_block);
-            while (getline(labelst, label_str, ',')) {
-                nnz_j++;
-                ImpLong idx = stoi(label_str);
-                M[nnz_j-1].idx = idx;
-                popular[idx] += 1;
-            }
-            nny[i] = nnz_j;
+#pragma omp parallel for schedule(dynamic) num_threads(nr_threads)
+    for (ImpInt c = 0; c < nr_chunks; c++) {
+        ReadChunk &ck = chunks[c];
+        copy(ck.fids.begin(), ck.fids.end(), fids.begin()+x_base[c]);
+        copy(ck.idx.begin(), ck.idx.end(), X.idx+x_base[c]);
+        copy(ck.vals.begin(), ck.vals.end(), X.val+x_base[c]);
+        copy(ck.labels.begin(), ck.labels.end(), Y.idx+y_base[c]);
+        copy(ck.nnx.begin(), ck.nnx.end(), nnx.begin()+row_base[c]);
+        copy(ck.nny.begin(), ck.nny.end(), nny.begin()+row_base[c]);
+
+        ImpLong x = x_base[c], y = y_base[c];
+        for (ImpLong i = row_base[c]; i < row_base[c+1]; i++) {
+            x += nnx[i];
+            y += nny[i];
+            X.ptr[i+1] = x;
+            Y.ptr[i+1] = y;
         }
+        ck = ReadChunk();
+    }
 
-        while (iss >> fid >> dummy >> idx >> dummy >> val) {
-            if (ds!= nullptr && ds[fid] <= idx)
-                continue;
-            nnz_i++;
-            N[nnz_i-1].fid = fid;
-            N[nnz_i-1].idx = idx;
-            N[nnz_i-1].val = val;
-        }
-        nnx[i] = nnz_i;
-        i++;
+    if (has_label) {
+        popular.assign(n, 0);
+        for (ImpLong s = 0; s < nnz_y; s++)
+            popular[Y.idx[s]] += 1;
+        if (nr_parts == 1)
+            normalize(popular);
     }
+}
 
-    X[0] = N.data();
-    for (ImpLong i = 0; i < m; i++) {
-        X[i+1] = N.data() + nnx[i];
+// True if str holds a digit; option values are then read by atoi or atof.
+bool is_numerical(const char *str) {
+    int c = 0;
+    for (; *str != '\0'; str++)
+        if (isdigit(*str))
+            c++;
+    return c > 0;
+}
+
+// The K list of --top-k, "5,10,20": positive, sorted and without repeats.
+vector<ImpInt> parse_top_k(const string &list) {
+    vector<ImpInt> top_k;
+    istringstream in(list);
+    string item;
+    while (getline(in, item, ',')) {
+        if (!is_numerical(item.c_str()) || atoi(item.c_str()) <= 0)
+            throw invalid_argument("--top-k should be followed by positive numbers");
+        top_k.push_back(atoi(item.c_str()));
     }
+    if (top_k.empty())
+        throw invalid_argument("--top-k should be followed by positive numbers");
+    sort(top_k.begin(), top_k.end());
+    top_k.erase(unique(top_k.begin(), top_k.end()), top_k.end());
+    return top_k;
+}
 
-    if (has_label) {
-        Y[0] = M.data();
-        for (ImpLong i = 0; i < m; i++) {
-            Y[i+1] = M.data() + nny[i];
-        }
+// Reads up to batch_size lines; returns false once the stream is exhausted.
+bool read_batch(istream &in, const ImpLong batch_size, string &buf) {
+    string line;
+    buf.clear();
+    for (ImpLong i = 0; i < batch_size && getline(in, line); i++) {
+        buf += line;
+        buf += '\n';
     }
+    return !buf.empty();
+}
 
-    ImpDouble sum = 0;
-    for (auto &n : popular)
-        sum += n;
-    for (auto &n : popular)
-        n /= sum;
+// Whether the lines of buf start with a label block, judged by the first
+// token of the first line: labels carry no ':', features do.
+bool has_label_block(const string &buf) {
+    const size_t eol = buf.find('\n');
+    const size_t start = buf.find_first_not_of(" \t");
+    if (start >= eol)
+        return false;
+    const size_t end = buf.find_first_of(" \t\n", start);
+    return buf.substr(start, end-start).find(':') == string::npos;
+}
 
-    for (ImpLong i = m-1; i > 0; i--) {
-        nnx[i] -= nnx[i-1];
-        nny[i] -= nny[i-1];
-    }
-    fs.close();
+void CSR::resize(const ImpLong nr_rows, const ImpLong nnz) {
+    this->nr_rows = nr_rows;
+    ptrs.assign(nr_rows+1, 0);
+    idxs.resize(nnz);
+    vals.assign(nnz, 0);
+    ptr = ptrs.data();
+    idx = idxs.data();
+    val = vals.data();
+}
+
+void CSR::clear() {
+    decltype(ptrs)().swap(ptrs);
+    decltype(idxs)().swap(idxs);
+    Vec().swap(vals);
+    nr_rows = 0;
+    ptr = nullptr;
+    idx = nullptr;
+    val = nullptr;
+}
+
+// Moves the arrays into scratch files (see DiskScope); the CSR owns them
+// afterwards even if it pointed into a mapped cache.
+void CSR::to_disk() {
+    if (ptr == nullptr)
+        return;
+    DiskScope disk(true);
+    decltype(ptrs) p(ptr, ptr+nr_rows+1);
+    decltype(idxs) i(idx, idx+nnz());
+    Vec v(val, val+nnz());
+    ptrs.swap(p);
+    idxs.swap(i);
+    vals.swap(v);
+    ptr = ptrs.data();
+    idx = idxs.data();
+    val = vals.data();
 }
 
-void ImpData::split_fields() {
-    Ns.resize(f);
+void ImpData::split_fields(const vector<ImpLong> &ds) {
+    // Rows split over ranks share the fields, dimensions and counts of the
+    // whole set.
+    const bool merge = (nr_parts > 1 && ds.empty());
+    if (!ds.empty())
+        f = ds.size();
+    if (merge) {
+        max_all(&f, 1);
+        max_all(&n, 1);
+        popular.resize(n, 0);
+        sum_all(popular.data(), n);
+        normalize(popular);
+    }
+
     Xs.resize(f);
     Ds.resize(f);
     freq.resize(f);
 
+    auto kept = [&] (const ImpLong s) {
+        return ds.empty() || (fids[s] < ds.size() && X.idx[s] < ds[fids[s]]);
+    };
 
     vector<ImpLong> f_sum_nnz(f, 0);
     vector<vector<ImpLong>> f_nnz(f);
 
+    // Hashed fields keep all their buckets, seen or not, and drop nothing.
     for (ImpInt fi = 0; fi < f; fi++) {
-        Ds[fi] = 0;
+        const ImpInt bits = (fi < hash_bits.size())? hash_bits[fi]: 0;
+        Ds[fi] = (!ds.empty())? ds[fi]: (bits > 0)? ImpLong(1) << bits: 0;
         f_nnz[fi].resize(m, 0);
-        Xs[fi].resize(m+1);
     }
 
+    nnz_x = 0;
     for (ImpLong i = 0; i < m; i++) {
-        for (Node* x = X[i]; x < X[i+1]; x++) {
-            ImpInt fid = x->fid;
+        nnx[i] = 0;
+        for (ImpLong s = X.ptr[i]; s < X.ptr[i+1]; s++) {
+            if (!kept(s))
+                continue;
+            const ImpInt fid = fids[s];
             f_sum_nnz[fid]++;
             f_nnz[fid][i]++;
+            nnx[i]++;
+            if (ds.empty())
+                Ds[fid] = max<ImpLong>(X.idx[s]+1, Ds[fid]);
         }
+        nnz_x += nnx[i];
     }
+    if (merge)
+        max_all(Ds.data(), f);
 
     for (ImpInt fi = 0; fi < f; fi++) {
-        Ns[fi].resize(f_sum_nnz[fi]);
+        CSR &X1 = Xs[fi];
+        X1.resize(m, f_sum_nnz[fi]);
+        for (ImpLong i = 0; i < m; i++)
+            X1.ptr[i+1] = X1.ptr[i] + f_nnz[fi][i];
         f_sum_nnz[fi] = 0;
+        freq[fi].assign(Ds[fi], 0);
     }
 
     for (ImpLong i = 0; i < m; i++) {
-        for (Node* x = X[i]; x < X[i+1]; x++) {
-            ImpInt fid = x->fid;
-            ImpLong idx = x->idx;
-            ImpDouble val = x->val;
-
-            f_sum_nnz[fid]++;
-            Ds[fid] = max(idx+1, Ds[fid]);
-            ImpLong nnz_i = f_sum_nnz[fid]-1;
-
-            Ns[fid][nnz_i].fid = fid;
-            Ns[fid][nnz_i].idx = idx;
-            Ns[fid][nnz_i].val = val;
+        for (ImpLong s = X.ptr[i]; s < X.ptr[i+1]; s++) {
+            if (!kept(s))
+                continue;
+            const ImpInt fid = fids[s];
+            const ImpLong nnz_i = f_sum_nnz[fid]++;
+            Xs[fid].idx[nnz_i] = X.idx[s];
+            Xs[fid].val[nnz_i] = X.val[s];
+            freq[fid][X.idx[s]]++;
         }
     }
+    if (merge)
+        for (ImpInt fi = 0; fi < f; fi++)
+            sum_all(freq[fi].data(), Ds[fi]);
 
-    for(ImpInt fi = 0; fi < f; fi++){
-        freq[fi].resize(Ds[fi]);
-        fill(freq[fi].begin(), freq[fi].end(), 0);
-    }
+    X.clear();
+    vector<ImpIdx>().swap(fids);
+}
 
-    for( ImpLong i = 0; i < m; i++){
-        for(Node* x = X[i]; x < X[i+1]; x++){
-            ImpInt fid = x->fid;
-            ImpLong idx = x->idx;
-            freq[fid][idx]++;
-        }
-    }
+// Keeps only the features at or past ds[fi] in each field, and only the
+// rows that have any, listed in rows[fi].
+void ImpData::restrict_fields(const vector<ImpLong> &ds) {
+    rows.assign(f, vector<ImpLong>());
     for (ImpInt fi = 0; fi < f; fi++) {
-        Node* fM = Ns[fi].data();
-        Xs[fi][0] = fM;
-        ImpLong start = 0;
+        const CSR &X1 = Xs[fi];
+        vector<ImpLong> &rows1 = rows[fi];
+        ImpLong nnz = 0;
         for (ImpLong i = 0; i < m; i++) {
-            Xs[fi][i+1] = fM + start + f_nnz[fi][i];
-            start += f_nnz[fi][i];
+            const ImpLong nnz0 = nnz;
+            for (ImpLong s = X1.ptr[i]; s < X1.ptr[i+1]; s++)
+                nnz += (X1.idx[s] >= ds[fi]);
+            if (nnz > nnz0)
+                rows1.push_back(i);
         }
-    }
 
-    X.clear();
-    X.shrink_to_fit();
-
-    N.clear();
-    N.shrink_to_fit();
+        CSR Xn;
+        Xn.resize(rows1.size(), nnz);
+        for (ImpLong t = 0; t < ImpLong(rows1.size()); t++) {
+            const ImpLong i = rows1[t];
+            ImpLong u = Xn.ptr[t];
+            for (ImpLong s = X1.ptr[i]; s < X1.ptr[i+1]; s++) {
+                if (X1.idx[s] < ds[fi])
+                    continue;
+                Xn.idx[u] = X1.idx[s];
+                Xn.val[u++] = X1.val[s];
+            }
+            Xn.ptr[t+1] = u;
+        }
+        Xs[fi] = move(Xn);
+    }
 }
 
-void ImpData::transY(const vector<Node*> &YT) {
-    n = YT.size() - 1;
-    vector<pair<ImpLong, Node*>> perm;
+void copy_rows(const CSR &A, const vector<ImpLong> &rows, CSR &B) {
     ImpLong nnz = 0;
-    vector<ImpLong> nnzs(m, 0);
-
-    for (ImpLong i = 0; i < n; i++)
-        for (Node* y = YT[i]; y < YT[i+1]; y++) {
-            if (y->idx >= m )
-              continue;
-            nnzs[y->idx]++;
-            perm.emplace_back(i, y);
-            nnz++;
-        }
+    for (const ImpLong r : rows)
+        nnz += A.ptr[r+1]-A.ptr[r];
+    B.resize(rows.size(), nnz);
+    for (ImpLong i = 0; i < ImpLong(rows.size()); i++) {
+        const ImpLong r = rows[i], len = A.ptr[r+1]-A.ptr[r];
+        copy(A.idx+A.ptr[r], A.idx+A.ptr[r+1], B.idx+B.ptr[i]);
+        copy(A.val+A.ptr[r], A.val+A.ptr[r+1], B.val+B.ptr[i]);
+        B.ptr[i+1] = B.ptr[i]+len;
+    }
+}
 
-    auto sort_by_column = [&] (const pair<ImpLong, Node*> &lhs,
-            const pair<ImpLong, Node*> &rhs) {
-        return tie(lhs.second->idx, lhs.first) < tie(rhs.second->idx, rhs.first);
-    };
+// The given rows, with their fields and labels, as a new data set.
+shared_ptr<ImpData> ImpData::select_rows(const vector<ImpLong> &rows) const {
+    shared_ptr<ImpData> D = make_shared<ImpData>(file_name);
+    D->m = rows.size();
+    D->n = n;
+    D->f = f;
+    D->Ds = Ds;
+    D->nnz_x = D->nnz_y = 0;
+    for (const ImpLong r : rows) {
+        D->nnx.push_back(nnx[r]);
+        D->nny.push_back(nny[r]);
+        D->nnz_x += nnx[r];
+        D->nnz_y += nny[r];
+    }
+    D->Xs.resize(f);
+    for (ImpInt fi = 0; fi < f; fi++)
+        copy_rows(Xs[fi], rows, D->Xs[fi]);
+    copy_rows(Y, rows, D->Y);
+    return D;
+}
 
-    sort(perm.begin(), perm.end(), sort_by_column);
+// Widens the fields to at least ds, e.g. to the rows of an earlier model;
+// the new features are unseen, so their counts are zero.
+void ImpData::grow_fields(const vector<ImpLong> &ds) {
+    for (ImpInt fi = 0; fi < f && fi < (ImpInt)ds.size(); fi++) {
+        if (ds[fi] <= Ds[fi])
+            continue;
+        Ds[fi] = ds[fi];
+        freq[fi].resize(Ds[fi], 0);
+    }
+}
 
-    M.resize(nnz);
-    nnz_y = nnz;
-    for (ImpLong nnz_i = 0; nnz_i < nnz; nnz_i++) {
-        M[nnz_i].idx = perm[nnz_i].first;
-        M[nnz_i].val = perm[nnz_i].second->val;
+void ImpData::transY(const CSR &YT) {
+    n = YT.nr_rows;
+    vector<ImpLong> start(m+1, 0);
+    for (ImpLong s = 0; s < YT.nnz(); s++)
+        if (YT.idx[s] < m)
+            start[YT.idx[s]+1]++;
+    partial_sum(start.begin(), start.end(), start.begin());
+
+    nnz_y = start[m];
+    Y.resize(m, nnz_y);
+    copy(start.begin(), start.end(), Y.ptr);
+    for (ImpLong i = 0; i < n; i++) {
+        for (ImpLong s = YT.ptr[i]; s < YT.ptr[i+1]; s++) {
+            const ImpLong j = YT.idx[s];
+            if (j >= m)
+                continue;
+            const ImpLong t = start[j]++;
+            Y.idx[t] = i;
+            Y.val[t] = YT.val[s];
+        }
     }
+}
 
-    Y[0] = M.data();
-    ImpLong start_idx = 0;
-    for (ImpLong i = 0; i < m; i++) {
-        start_idx += nnzs[i];
-        Y[i+1] = M.data()+start_idx;
+// Feature-major copy of every field: row j of XTs[fi] lists the rows using
+// feature j, in row order.
+void ImpData::transpose_fields() {
+    XTs.resize(f);
+    for (ImpInt fi = 0; fi < f; fi++)
+        XTs[fi].resize(Ds[fi], Xs[fi].nnz());
+
+#pragma omp parallel for schedule(dynamic)
+    for (ImpInt fi = 0; fi < f; fi++) {
+        const CSR &X1 = Xs[fi];
+        CSR &XT = XTs[fi];
+        const ImpLong df = Ds[fi];
+        for (ImpLong s = 0; s < X1.nnz(); s++)
+            XT.ptr[X1.idx[s]+1]++;
+        partial_sum(XT.ptr, XT.ptr+df+1, XT.ptr);
+
+        vector<ImpLong> start(XT.ptr, XT.ptr+df);
+        for (ImpLong i = 0; i < X1.nr_rows; i++) {
+            for (ImpLong s = X1.ptr[i]; s < X1.ptr[i+1]; s++) {
+                const ImpLong t = start[X1.idx[s]]++;
+                XT.idx[t] = i;
+                XT.val[t] = X1.val[s];
+            }
+        }
     }
 }
 
@@ -311,25 +774,532 @@ void ImpData::print_data_info() {
     cout << endl;
 }
 
-void ImpProblem::UTx(const Node* x0, const Node* x1, const Vec &A, ImpDouble *c) {
-    for (const Node* x = x0; x < x1; x++) {
-        const ImpLong idx = x->idx;
-        const ImpDouble val = x->val;
-        for (ImpInt d = 0; d < k; d++) {
-            ImpLong jd = idx*k+d;
-            c[d] += val*A[jd];
+ImpMap::ImpMap(const string &path, bool writable): addr(nullptr), size(0) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *p = (writable)?
+            mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0):
+            mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            addr = static_cast<char*>(p);
+            size = st.st_size;
         }
     }
+    close(fd);
+}
+
+ImpMap::~ImpMap() {
+    if (addr != nullptr)
+        munmap(addr, size);
+}
+
+string disk_dir;
+thread_local bool disk_on = false;
+bool numa_on = false;
+// Scratch and NUMA mappings with their lengths, unmapped by map_free.
+mutex map_mutex;
+unordered_map<void*, size_t> mapped_blocks;
+
+void set_disk_dir(const string &dir) {
+    disk_dir = dir;
+}
+
+DiskScope::DiskScope(bool on): prev(disk_on) {
+    disk_on = on;
+}
+
+DiskScope::~DiskScope() {
+    disk_on = prev;
 }
 
-void ImpProblem::UTX(const vector<Node*> &X, const ImpLong m1, const Vec &A, Vec &C) {
+void* disk_alloc(const size_t bytes) {
+    if (!disk_on || disk_dir.empty())
+        return nullptr;
+    string path = disk_dir + "/imp.XXXXXX";
+    const int fd = mkstemp(&path[0]);
+    if (fd < 0)
+        throw invalid_argument("cannot create a scratch file in " + disk_dir);
+    unlink(path.c_str());
+    void *p = (ftruncate(fd, bytes) == 0)?
+        mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0): MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED)
+        throw invalid_argument("cannot map a scratch file in " + disk_dir);
+    madvise(p, bytes, MADV_SEQUENTIAL);
+
+    lock_guard<mutex> lock(map_mutex);
+    mapped_blocks[p] = bytes;
+    return p;
+}
+
+bool map_free(void *p) {
+    lock_guard<mutex> lock(map_mutex);
+    auto it = mapped_blocks.find(p);
+    if (it == mapped_blocks.end())
+        return false;
+    munmap(p, it->second);
+    mapped_blocks.erase(it);
+    return true;
+}
+
+const size_t HUGE_PAGE = 1<<21;
+
+void set_numa(bool on) {
+    numa_on = on;
+}
+
+void* numa_alloc(const size_t bytes) {
+    if (!numa_on)
+        return nullptr;
+    const size_t len = (bytes+HUGE_PAGE-1) & ~(HUGE_PAGE-1);
+    void *raw = mmap(nullptr, len+HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return nullptr;
+    char *begin = static_cast<char*>(raw);
+    char *p = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw)+HUGE_PAGE-1) & ~(HUGE_PAGE-1));
+    if (p > begin)
+        munmap(begin, p-begin);
+    munmap(p+len, begin+len+HUGE_PAGE-(p+len));
+    madvise(p, len, MADV_HUGEPAGE);
+
+    const ImpLong page = sysconf(_SC_PAGESIZE), nr_pages = len/page;
+#pragma omp parallel for schedule(static) if(!omp_in_parallel())
+    for (ImpLong i = 0; i < nr_pages; i++)
+        p[i*page] = 0;
+
+    lock_guard<mutex> lock(map_mutex);
+    mapped_blocks[p] = len;
+    return p;
+}
+
+// Node of every cpu, from the cpulist of each node; 0 without sysfs.
+vector<int> cpu_nodes() {
+    vector<int> nodes(CPU_SETSIZE, 0);
+    for (int node = 0; ; node++) {
+        ifstream in("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        if (!in.is_open())
+            break;
+        string range;
+        while (getline(in, range, ',')) {
+            int lo = 0, hi = 0;
+            const int nr_read = sscanf(range.c_str(), "%d-%d", &lo, &hi);
+            for (int cpu = lo; nr_read > 0 && cpu <= ((nr_read == 2)? hi: lo) && cpu < CPU_SETSIZE; cpu++)
+                nodes[cpu] = node;
+        }
+    }
+    return nodes;
+}
+
+void pin_threads() {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return;
+    const vector<int> nodes = cpu_nodes();
+    vector<pair<int, int>> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed))
+            cpus.emplace_back(nodes[cpu], cpu);
+    sort(cpus.begin(), cpus.end());
+#pragma omp parallel
+    {
+        const ImpLong t = omp_get_thread_num(), nr_th = omp_get_num_threads();
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpus[t*cpus.size()/nr_th].second, &one);
+        sched_setaffinity(0, sizeof(one), &one);
+    }
+}
+
+// Share of the resident pages on each node, from up to 4096 pages sampled
+// evenly over the blocks.
+string numa_report(const vector<pair<const void*, size_t>> &blocks) {
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    size_t total = 0;
+    for (const auto &block : blocks)
+        total += block.second/page;
+    const size_t step = max<size_t>(1, total/4096);
+
+    vector<void*> pages;
+    for (const auto &block : blocks) {
+        const uintptr_t begin = reinterpret_cast<uintptr_t>(block.first) & ~(page-1);
+        for (size_t i = 0; i*page < block.second; i += step)
+            pages.push_back(reinterpret_cast<void*>(begin+i*page));
+    }
+    vector<int> status(pages.size(), -1);
+    if (pages.empty() || syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, status.data(), 0) != 0)
+        return "unknown";
+
+    map<int, size_t> counts;
+    size_t resident = 0;
+    for (const int node : status)
+        if (node >= 0) {
+            counts[node]++;
+            resident++;
+        }
+    if (resident == 0)
+        return "unknown";
+    ostringstream out;
+    out << setprecision(3);
+    string sep;
+    for (const auto &count : counts) {
+        out << sep << "node" << count.first << " " << 100.0*count.second/resident << "%";
+        sep = " ";
+    }
+    return out.str();
+}
+
+// The transparent huge page mode, and the anonymous memory it backs.
+string thp_report() {
+    string mode = "unknown", line;
+    ifstream enabled("/sys/kernel/mm/transparent_hugepage/enabled");
+    if (getline(enabled, line) && line.find('[') != string::npos)
+        mode = line.substr(line.find('[')+1, line.find(']')-line.find('[')-1);
+    ifstream rollup("/proc/self/smaps_rollup");
+    while (getline(rollup, line))
+        if (line.compare(0, 14, "AnonHugePages:") == 0)
+            return mode + ", " + to_string(atol(line.c_str()+14)/1024) + " MB in huge pages";
+    return mode;
+}
+
+// Starts reading the pages of [p, p+bytes) in the background.
+void prefetch(const void *p, const size_t bytes) {
+    if (bytes == 0)
+        return;
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(p) & ~(page-1);
+    madvise(reinterpret_cast<void*>(begin), reinterpret_cast<uintptr_t>(p)+bytes-begin, MADV_WILLNEED);
+}
+
+// The block of the running kernels, if in_block is set.
+thread_local bool in_block = false;
+thread_local pair<ImpInt, ImpInt> cur_block;
+
+Telemetry::Telemetry(const string &path): out(path, ios::out | ios::trunc) {
+    if (!out.is_open())
+        throw invalid_argument("cannot open " + path);
+}
+
+void Telemetry::add(const char *kernel, const ImpDouble time, const ImpLong bytes) {
+    lock_guard<mutex> guard(lock);
+    KernelStat &ks = kernels[kernel];
+    ks.time += time;
+    ks.calls++;
+    ks.bytes += bytes;
+    if (!in_block)
+        return;
+    KernelStat &bs = blocks[cur_block].kernels[kernel];
+    bs.time += time;
+    bs.calls++;
+    bs.bytes += bytes;
+}
+
+void Telemetry::add_cg(const ImpInt nr_cg, const bool capped, const ImpDouble res_ratio) {
+    if (!in_block)
+        return;
+    lock_guard<mutex> guard(lock);
+    BlockStat &bs = blocks[cur_block];
+    bs.cg_calls++;
+    bs.cg_iters += nr_cg;
+    bs.cg_capped += capped;
+    bs.res_ratio = max(bs.res_ratio, res_ratio);
+}
+
+void Telemetry::put(const string &key, const ImpDouble value) {
+    lock_guard<mutex> guard(lock);
+    values.emplace_back(key, value);
+}
+
+void write_kernels(ofstream &out, const map<string, KernelStat> &kernels) {
+    out << '{';
+    for (auto it = kernels.begin(); it != kernels.end(); it++) {
+        out << ((it == kernels.begin())? "": ",") << '"' << it->first << "\":{\"calls\":"
+            << it->second.calls << ",\"time\":" << it->second.time
+            << ",\"bytes\":" << it->second.bytes << '}';
+    }
+    out << '}';
+}
+
+// {"epoch":1,"time":...,<values>,"kernels":{...},"blocks":[{"f1":0,"f2":2,
+// "cg_calls":...,"cg_iters":...,"cg_capped":...,"res_ratio":...,"kernels":{...}}]}
+void Telemetry::flush(const ImpInt epoch, const ImpDouble time) {
+    lock_guard<mutex> guard(lock);
+    out << setprecision(6) << "{\"epoch\":" << epoch << ",\"time\":" << time;
+    for (const auto &v : values)
+        out << ",\"" << v.first << "\":" << v.second;
+    out << ",\"kernels\":";
+    write_kernels(out, kernels);
+    out << ",\"blocks\":[";
+    for (auto it = blocks.begin(); it != blocks.end(); it++) {
+        const BlockStat &bs = it->second;
+        out << ((it == blocks.begin())? "": ",") << "{\"f1\":" << it->first.first
+            << ",\"f2\":" << it->first.second << ",\"cg_calls\":" << bs.cg_calls
+            << ",\"cg_iters\":" << bs.cg_iters << ",\"cg_capped\":" << bs.cg_capped
+            << ",\"res_ratio\":" << bs.res_ratio << ",\"kernels\":";
+        write_kernels(out, bs.kernels);
+        out << '}';
+    }
+    out << "]}" << endl;
+    kernels.clear();
+    blocks.clear();
+    values.clear();
+}
+
+BlockScope::BlockScope(const ImpInt f1, const ImpInt f2): prev(cur_block), prev_in(in_block) {
+    cur_block = make_pair(f1, f2);
+    in_block = true;
+}
+
+BlockScope::~BlockScope() {
+    cur_block = prev;
+    in_block = prev_in;
+}
+
+KernelTimer::KernelTimer(const shared_ptr<Telemetry> &tel, const char *kernel, const ImpLong bytes)
+    : tel(tel.get()), kernel(kernel), bytes(bytes), t0((tel == nullptr)? 0: omp_get_wtime()) {}
+
+KernelTimer::~KernelTimer() {
+    if (tel != nullptr)
+        tel->add(kernel, omp_get_wtime()-t0, bytes);
+}
+
+ImpLong nr_bytes(const CSR &A) {
+    return A.nnz()*(sizeof(ImpIdx)+sizeof(ImpFloat)) + (A.nr_rows+1)*sizeof(ImpLong);
+}
+
+ImpLong nr_bytes(const Vec &A) {
+    return A.size()*sizeof(ImpFloat);
+}
+
+const char CACHE_MAGIC[8] = {'I', 'M', 'P', 'C', 'A', 'C', 'H', 'E'};
+const char MODEL_MAGIC[8] = {'I', 'M', 'P', 'M', 'O', 'D', 'E', 'L'};
+const size_t CACHE_ALIGN = 64;
+const ImpLong CACHE_SIG_SIZE = 3;
+
+// Hashing changes the parsed indices, so it is part of the signature.
+void file_signature(const string &path, const vector<ImpInt> &hash_bits, ImpLong *sig) {
+    struct stat st;
+    string key = path;
+    for (const ImpInt bits : hash_bits)
+        key += ":" + to_string(bits);
+    sig[0] = hash<string>()(key);
+    sig[1] = sig[2] = 0;
+    if (stat(path.c_str(), &st) == 0) {
+        sig[1] = st.st_size;
+        sig[2] = st.st_mtim.tv_sec*1000000000L + st.st_mtim.tv_nsec;
+    }
+}
+
+template <typename T>
+void write_array(ofstream &o_f, const T *p, const ImpLong count) {
+    const size_t bytes = sizeof(T)*count;
+    const char zeros[CACHE_ALIGN] = {0};
+    if (bytes > 0)
+        o_f.write(reinterpret_cast<const char*>(p), bytes);
+    o_f.write(zeros, (CACHE_ALIGN - bytes%CACHE_ALIGN)%CACHE_ALIGN);
+}
+
+template <typename T>
+T* map_array(const shared_ptr<ImpMap> &c, size_t &offset, const ImpLong count) {
+    const size_t bytes = sizeof(T)*count;
+    if (offset+bytes > c->size)
+        return nullptr;
+    T* p = reinterpret_cast<T*>(c->addr+offset);
+    offset += bytes + (CACHE_ALIGN - bytes%CACHE_ALIGN)%CACHE_ALIGN;
+    return p;
+}
+
+void write_csr(ofstream &o_f, const CSR &A) {
+    write_array(o_f, A.ptr, A.nr_rows+1);
+    write_array(o_f, A.idx, A.nnz());
+    write_array(o_f, A.val, A.nnz());
+}
+
+bool map_csr(const shared_ptr<ImpMap> &c, size_t &offset, const ImpLong nr_rows, CSR &A) {
+    A.ptr = map_array<ImpLong>(c, offset, nr_rows+1);
+    if (A.ptr == nullptr)
+        return false;
+    A.nr_rows = nr_rows;
+    A.idx = map_array<ImpIdx>(c, offset, A.nnz());
+    A.val = map_array<ImpFloat>(c, offset, A.nnz());
+    return A.idx != nullptr && A.val != nullptr;
+}
+
+void ImpData::write_cache(ofstream &o_f) const {
+    const ImpLong nr_popular = popular.size();
+    ImpLong head[CACHE_SIG_SIZE+6];
+    file_signature(file_name, hash_bits, head);
+    ImpLong *dims = head+CACHE_SIG_SIZE;
+    dims[0] = m; dims[1] = n; dims[2] = f;
+    dims[3] = nnz_x; dims[4] = nnz_y; dims[5] = nr_popular;
+    write_array(o_f, head, CACHE_SIG_SIZE+6);
+
+    write_array(o_f, nnx.data(), m);
+    write_array(o_f, nny.data(), m);
+    write_array(o_f, Ds.data(), f);
+
+    for (ImpInt fi = 0; fi < f; fi++)
+        write_csr(o_f, Xs[fi]);
+    write_csr(o_f, Y);
+
+    for (ImpInt fi = 0; fi < f; fi++)
+        write_array(o_f, freq[fi].data(), Ds[fi]);
+    write_array(o_f, popular.data(), nr_popular);
+}
+
+bool ImpData::map_cache(const shared_ptr<ImpMap> &c, size_t &offset) {
+    ImpLong sig[CACHE_SIG_SIZE];
+    file_signature(file_name, hash_bits, sig);
+    const ImpLong *head = map_array<ImpLong>(c, offset, CACHE_SIG_SIZE+6);
+    if (head == nullptr || !equal(sig, sig+CACHE_SIG_SIZE, head))
+        return false;
+
+    const ImpLong *dims = head+CACHE_SIG_SIZE;
+    m = dims[0]; n = dims[1]; f = dims[2];
+    nnz_x = dims[3]; nnz_y = dims[4];
+    const ImpLong nr_popular = dims[5];
+
+    const ImpLong *nnx_p = map_array<ImpLong>(c, offset, m);
+    const ImpLong *nny_p = map_array<ImpLong>(c, offset, m);
+    const ImpLong *ds_p = map_array<ImpLong>(c, offset, f);
+    if (nnx_p == nullptr || nny_p == nullptr || ds_p == nullptr)
+        return false;
+    nnx.assign(nnx_p, nnx_p+m);
+    nny.assign(nny_p, nny_p+m);
+    Ds.assign(ds_p, ds_p+f);
+
+    Xs.resize(f);
+    for (ImpInt fi = 0; fi < f; fi++)
+        if (!map_csr(c, offset, m, Xs[fi]))
+            return false;
+    if (!map_csr(c, offset, m, Y))
+        return false;
+
+    freq.resize(f);
+    for (ImpInt fi = 0; fi < f; fi++) {
+        const ImpLong *freq_p = map_array<ImpLong>(c, offset, Ds[fi]);
+        if (freq_p == nullptr)
+            return false;
+        freq[fi].assign(freq_p, freq_p+Ds[fi]);
+    }
+
+    const ImpDouble *popular_p = map_array<ImpDouble>(c, offset, nr_popular);
+    if (popular_p == nullptr)
+        return false;
+    popular.assign(popular_p, popular_p+nr_popular);
+
+    cache = c;
+    return true;
+}
+
+bool load_cache(const string &cache_path, vector<shared_ptr<ImpData>> &sets) {
+    shared_ptr<ImpMap> c = make_shared<ImpMap>(cache_path);
+    if (c->addr == nullptr)
+        return false;
+
+    size_t offset = 0;
+    const char *magic = map_array<char>(c, offset, sizeof(CACHE_MAGIC));
+    const ImpLong *head = map_array<ImpLong>(c, offset, 3);
+    if (magic == nullptr || head == nullptr
+            || !equal(CACHE_MAGIC, CACHE_MAGIC+sizeof(CACHE_MAGIC), magic)
+            || head[0] != DATA_CACHE_VERSION || head[1] != sizeof(ImpFloat)
+            || head[2] != sets.size())
+        return false;
+
+    vector<shared_ptr<ImpData>> mapped;
+    for (auto &d : sets) {
+        mapped.push_back(make_shared<ImpData>(d->file_name));
+        mapped.back()->hash_bits = d->hash_bits;
+        if (!mapped.back()->map_cache(c, offset))
+            return false;
+    }
+    sets = mapped;
+    return true;
+}
+
+// Written next to the cache and renamed over it, so a process that has the
+// old cache mapped keeps its file and a failed write leaves it intact.
+void save_cache(const string &cache_path, const vector<shared_ptr<ImpData>> &sets) {
+    const string tmp = cache_path + ".tmp";
+    ofstream o_f(tmp, ios::binary | ios::trunc);
+    const ImpLong head[3] = {DATA_CACHE_VERSION, sizeof(ImpFloat), ImpLong(sets.size())};
+    write_array(o_f, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    write_array(o_f, head, 3);
+    for (auto &d : sets)
+        d->write_cache(o_f);
+    o_f.close();
+    if (!o_f || rename(tmp.c_str(), cache_path.c_str()) != 0) {
+        remove(tmp.c_str());
+        cerr << "fail to write cache " << cache_path << endl;
+    }
+}
+
+// Rows [tiles[t], tiles[t+1]) of X hold about equal nonzeros, several
+// tiles per thread, so rows of popular features do not stall one thread.
+static void row_tiles(const CSR &X, vector<ImpLong> &tiles) {
+    const ImpLong nr_tiles = 16*omp_get_max_threads(), nnz = X.nnz();
+    tiles.assign(1, 0);
+    for (ImpLong t = 1; t < nr_tiles && tiles.back() < X.nr_rows; t++) {
+        const ImpLong i = upper_bound(X.ptr, X.ptr+X.nr_rows, nnz*t/nr_tiles)-X.ptr;
+        if (i > tiles.back())
+            tiles.push_back(i);
+    }
+    if (tiles.back() < X.nr_rows)
+        tiles.push_back(X.nr_rows);
+}
+
+void ImpProblem::UTx(const CSR &X, const ImpLong i, const ImpFloat *A, ImpFloat *c) {
+    const ImpFloat *xv = X.val;
+    gather_k(X.idx, [xv] (const ImpLong s) { return xv[s]; }, X.ptr[i], X.ptr[i+1], A, c, k);
+}
+void ImpProblem::UTX(const CSR &X, const ImpLong m1, const ImpFloat *A, Vec &C) {
     fill(C.begin(), C.end(), 0);
-    ImpDouble* c = C.data();
-#pragma omp parallel for schedule(guided)
-    for (ImpLong i = 0; i < m1; i++)
-        UTx(X[i], X[i+1], A, c+i*k);
+    ImpFloat* c = C.data();
+    Workspace ws;
+    vector<ImpLong> &tiles = ws.lvec(0);
+    row_tiles(X, tiles);
+#pragma omp parallel for schedule(dynamic)
+    for (ImpLong t = 0; t < ImpLong(tiles.size())-1; t++)
+        for (ImpLong i = tiles[t]; i < min(tiles[t+1], m1); i++)
+            UTx(X, i, A, c+i*k);
 }
 
+// Projections through a quantized block; each row is widened as it is
+// gathered and its scale joins the feature value.
+void ImpProblem::UTX(const CSR &X, const ImpLong m1, const QBlock &A, Vec &C) {
+    fill(C.begin(), C.end(), 0);
+    ImpFloat* c = C.data();
+    Workspace ws;
+    vector<ImpLong> &tiles = ws.lvec(0);
+    row_tiles(X, tiles);
+    const ImpIdx *xi = X.idx;
+    const ImpFloat *xv = X.val;
+    const float *sc = A.scale;
+    const auto val = [xi, xv, sc] (const ImpLong s) { return ImpDouble(xv[s])*sc[xi[s]]; };
+#pragma omp parallel for schedule(dynamic)
+    for (ImpLong t = 0; t < ImpLong(tiles.size())-1; t++) {
+        for (ImpLong i = tiles[t]; i < min(tiles[t+1], m1); i++) {
+            if (A.bytes == QUANT_INT8)
+                gather_k(xi, val, X.ptr[i], X.ptr[i+1], static_cast<const int8_t*>(A.q), c+i*k, k);
+            else
+                gather_k(xi, val, X.ptr[i], X.ptr[i+1], static_cast<const Half*>(A.q), c+i*k, k);
+        }
+    }
+}
+
+void ImpProblem::XTC(const CSR &XT, const Vec &C, Vec &G) {
+    const ImpFloat *cp = C.data();
+    ImpFloat *gp = G.data();
+    Workspace ws;
+    vector<ImpLong> &tiles = ws.lvec(0);
+    row_tiles(XT, tiles);
+#pragma omp parallel for schedule(dynamic)
+    for (ImpLong t = 0; t < ImpLong(tiles.size())-1; t++)
+        for (ImpLong j = tiles[t]; j < tiles[t+1]; j++)
+            UTx(XT, j, cp, gp+j*k);
+}
 
 void ImpProblem::init_pair(const ImpInt &f12,
         const ImpInt &fi, const ImpInt &fj,
@@ -338,21 +1308,32 @@ void ImpProblem::init_pair(const ImpInt &f12,
     const ImpLong Df1 = d1->Ds[fi];
     const ImpLong Df2 = d2->Ds[fj];
 
-    const vector<Node*> &X1 = d1->Xs[fi];
-    const vector<Node*> &X2 = d2->Xs[fj];
+    const CSR &X1 = d1->Xs[fi];
+    const CSR &X2 = d2->Xs[fj];
 
     init_mat(W[f12], Df1, k);
     init_mat(H[f12], Df2, k);
-    P[f12].resize(d1->m*k, 0);
-    Q[f12].resize(d2->m*k, 0);
-    UTX(X1, d1->m, W[f12], P[f12]);
-    UTX(X2, d2->m, H[f12], Q[f12]);
+    // Rows of an earlier model are kept; features added since start randomly.
+    if (!W0.empty() && !W0[f12].empty()) {
+        copy(W0[f12].begin(), W0[f12].end(), W[f12].begin());
+        copy(H0[f12].begin(), H0[f12].end(), H[f12].begin());
+    }
+    {
+        DiskScope disk(d1 == U);
+        P[f12].resize(d1->m*k, 0);
+    }
+    {
+        DiskScope disk(d2 == U);
+        Q[f12].resize(d2->m*k, 0);
+    }
+    UTX(X1, d1->m, W[f12].data(), P[f12]);
+    UTX(X2, d2->m, H[f12].data(), Q[f12]);
 }
 
 void ImpProblem::add_side(const Vec &p, const Vec &q, const ImpLong &m1, Vec &a1) {
-    const ImpDouble *pp = p.data(), *qp = q.data();
+    const ImpFloat *pp = p.data(), *qp = q.data();
     for (ImpLong i = 0; i < m1; i++) {
-        const ImpDouble *pi = pp+i*k, *qi = qp+i*k;
+        const ImpFloat *pi = pp+i*k, *qi = qp+i*k;
         a1[i] += inner(pi, qi, k);
     }
 }
@@ -373,12 +1354,17 @@ void ImpProblem::calc_side() {
 }
 
 ImpDouble ImpProblem::calc_cross(const ImpLong &i, const ImpLong &j) {
+    return calc_cross(P, Q, i, j);
+}
+
+ImpDouble ImpProblem::calc_cross(const vector<Vec> &Pu, const vector<Vec> &Qi,
+        const ImpLong &i, const ImpLong &j) {
     ImpDouble cross_value = 0.0;
     for (ImpInt f1 = 0; f1 < fu; f1++) {
         for (ImpInt f2 = fu; f2 < f; f2++) {
             const ImpInt f12 = index_vec(f1, f2, f);
-            const ImpDouble *pp = P[f12].data();
-            const ImpDouble *qp = Q[f12].data();
+            const ImpFloat *pp = Pu[f12].data();
+            const ImpFloat *qp = Qi[f12].data();
             cross_value += inner(pp+i*k, qp+j*k, k);
         }
     }
@@ -386,82 +1372,148 @@ ImpDouble ImpProblem::calc_cross(const ImpLong &i, const ImpLong &j) {
 }
 
 void ImpProblem::init_y_tilde() {
+    CSR &UY = U->Y, &VY = V->Y;
     #pragma omp parallel for schedule(guided)
     for (ImpLong i = 0; i < m; i++) {
-        for (Node* y = U->Y[i]; y < U->Y[i+1]; y++) {
-            ImpLong j = y->idx;
-            y->val = a[i]+b[j]+calc_cross(i, j) - 1;
+        for (ImpLong s = UY.ptr[i]; s < UY.ptr[i+1]; s++) {
+            ImpLong j = UY.idx[s];
+            UY.val[s] = a[i]+b[j]+calc_cross(i, j) - 1;
         }
     }
-    #pragma omp parallel for schedule(guided)
-    for (ImpLong j = 0; j < n; j++) {
-        for (Node* y = V->Y[j]; y < V->Y[j+1]; y++) {
-            ImpLong i = y->idx;
-            y->val = a[i]+b[j]+calc_cross(i, j) - 1;
+    // V->Y holds the same pairs by item, in user order.
+    vector<ImpLong> next(VY.ptr, VY.ptr+n);
+    for (ImpLong i = 0; i < m; i++) {
+        for (ImpLong s = UY.ptr[i]; s < UY.ptr[i+1]; s++) {
+            const ImpLong j = UY.idx[s];
+            if (j < n)
+                VY.val[next[j]++] = UY.val[s];
         }
     }
 }
 
-void ImpProblem::update_side(const bool &sub_type, const Vec &S
-        , const Vec &Q1, Vec &W1, const vector<Node*> &X12, Vec &P1) {
+// Under fold-in only the rows of field f1 with new features move: their
+// positives are found on both copies of Y through twin, and the sums the
+// cross steps read are moved by the same rows.
+void ImpProblem::update_side(const ImpInt &f1, const Vec &S
+        , const Vec &Q1, Vec &W1, Vec &P1) {
 
-    const ImpLong m1 = (sub_type)? m : n;
+    const bool sub_type = f1 < fu;
+    shared_ptr<ImpData> U1 = (sub_type)? U:V;
+    shared_ptr<ImpData> V1 = (sub_type)? V:U;
+    const CSR &X12 = U1->Xs[(sub_type)? f1: f1-fu];
+    const RowSet rows = rows_of(f1);
+    KernelTimer timer(tel, "update_side", nr_bytes(X12)+nr_bytes(U->Y)+nr_bytes(V->Y)
+            +3*nr_bytes(P1)+nr_bytes(Q1)+3*nr_bytes(S));
     // Update W1
-    axpy( S.data(), W1.data(), S.size(), 1);
+    const ImpLong o = (param->fold_in)? D0[f1]*k: 0;
+    axpy( S.data()+o, W1.data()+o, S.size()-o, 1);
 
     // Update y_tilde and pq
     Vec &a1 = (sub_type)? a:b;
-    shared_ptr<ImpData> U1 = (sub_type)? U:V;
-    shared_ptr<ImpData> V1 = (sub_type)? V:U;
 
-    Vec gaps(m1, 0);
-    Vec XS(P1.size(), 0);
-    UTX(X12, m1, S, XS);
-    axpy( XS.data(), P1.data(), XS.size(), 1);
-    row_wise_inner(XS, Q1, m1, k, 1, gaps);
+    Workspace ws;
+    Vec &gaps = ws.vec(rows.size, 0, sub_type), &XS = ws.vec(rows.size*k, 0, sub_type);
+    UTX(X12, rows.size, S.data(), XS);
+    ImpFloat *pp = P1.data();
+    const ImpFloat *qp = Q1.data();
+    #pragma omp parallel for schedule(guided)
+    for (ImpLong t = 0; t < rows.size; t++) {
+        const ImpLong i = rows[t];
+        axpy_k(XS.data()+t*k, pp+i*k, k, 1);
+        gaps[t] = inner(XS.data()+t*k, qp+i*k, k);
+    }
 
+    CSR &UY = U1->Y, &VY = V1->Y;
     #pragma omp parallel for schedule(guided)
-    for (ImpLong i = 0; i < U1->m; i++) {
-        a1[i] += gaps[i];
-        for (Node* y = U1->Y[i]; y < U1->Y[i+1]; y++) {
-            y->val += gaps[i];
+    for (ImpLong t = 0; t < rows.size; t++) {
+        const ImpLong i = rows[t];
+        a1[i] += gaps[t];
+        for (ImpLong s = UY.ptr[i]; s < UY.ptr[i+1]; s++) {
+            UY.val[s] += gaps[t];
+        }
+        if (param->fold_in) {
+            const vector<ImpLong> &tw = twin[f1];
+            for (ImpLong u = twin_ptr[f1][t]; u < twin_ptr[f1][t+1]; u++)
+                if (tw[u] < VY.nnz())
+                    VY.val[tw[u]] += gaps[t];
         }
     }
+    if (!param->fold_in) {
     #pragma omp parallel for schedule(guided)
-    for (ImpLong j = 0; j < V1->m; j++) {
-        for (Node* y = V1->Y[j]; y < V1->Y[j+1]; y++) {
-            const ImpLong i = y->idx;
-            y->val += gaps[i];
+        for (ImpLong j = 0; j < V1->m; j++) {
+            for (ImpLong s = VY.ptr[j]; s < VY.ptr[j+1]; s++) {
+                const ImpLong i = VY.idx[s];
+                VY.val[s] += gaps[i];
+            }
         }
+        return;
     }
-}
 
-void ImpProblem::update_cross(const bool &sub_type, const Vec &S,
-        const Vec &Q1, Vec &W1, const vector<Node*> &X12, Vec &P1) {
-    axpy( S.data(), W1.data(), S.size(), 1);
-    const ImpLong m1 = (sub_type)? m : n;
+    SideSums &S1 = sums[(sub_type)? 0: 1];
+    for (ImpLong t = 0; t < rows.size; t++)
+        S1.self += gaps[t];
+    for (ImpInt c = 0; c < fu*fv; c++) {
+        const ImpInt f12 = index_vec(c/fv, fu+c%fv, f);
+        const ImpFloat *xp = ((sub_type)? P[f12]: Q[f12]).data();
+        vector<ImpDouble> &so = S1.so[c];
+        for (ImpLong t = 0; t < rows.size; t++)
+            for (ImpInt d = 0; d < k; d++)
+                so[d] += gaps[t]*xp[rows[t]*k+d];
+    }
+}
 
+void ImpProblem::update_cross(const ImpInt &f1, const ImpInt &f12, const Vec &S,
+        const Vec &Q1, Vec &W1, Vec &P1) {
+    const bool sub_type = f1 < fu;
     shared_ptr<ImpData> U1 = (sub_type)? U:V;
     shared_ptr<ImpData> V1 = (sub_type)? V:U;
-
-    Vec XS(P1.size(), 0);
-    UTX(X12, m1, S, XS);
-    axpy( XS.data(), P1.data(), P1.size(), 1);
-
+    const CSR &X12 = U1->Xs[(sub_type)? f1: f1-fu];
+    const RowSet rows = rows_of(f1);
+    KernelTimer timer(tel, "update_cross", nr_bytes(X12)+nr_bytes(U->Y)+nr_bytes(V->Y)
+            +3*nr_bytes(P1)+2*nr_bytes(Q1)+3*nr_bytes(S));
+    const ImpLong o = (param->fold_in)? D0[f1]*k: 0;
+    axpy( S.data()+o, W1.data()+o, S.size()-o, 1);
+
+    Workspace ws;
+    Vec &XS = ws.vec(rows.size*k, 0, sub_type);
+    UTX(X12, rows.size, S.data(), XS);
+    CSR &UY = U1->Y, &VY = V1->Y;
+    if (!param->fold_in) {
+        axpy( XS.data(), P1.data(), P1.size(), 1);
+    #pragma omp parallel for schedule(guided)
+        for (ImpLong i = 0; i < U1->m; i++) {
+            for (ImpLong s = UY.ptr[i]; s < UY.ptr[i+1]; s++) {
+                const ImpLong j = UY.idx[s];
+                UY.val[s] += inner( XS.data()+i*k, Q1.data()+j*k, k);
+            }
+        }
     #pragma omp parallel for schedule(guided)
-    for (ImpLong i = 0; i < U1->m; i++) {
-        for (Node* y = U1->Y[i]; y < U1->Y[i+1]; y++) {
-            const ImpLong j = y->idx;
-            y->val += inner( XS.data()+i*k, Q1.data()+j*k, k);
+        for (ImpLong j = 0; j < V1->m; j++) {
+            for (ImpLong s = VY.ptr[j]; s < VY.ptr[j+1]; s++) {
+                const ImpLong i = VY.idx[s];
+                VY.val[s] += inner( XS.data()+i*k, Q1.data()+j*k, k);
+            }
         }
+        return;
     }
+
+    const ImpInt c = cross_index(f12);
+    add_sums(sub_type, c, rows, -1);
+    const vector<ImpLong> &tw = twin[f1];
     #pragma omp parallel for schedule(guided)
-    for (ImpLong j = 0; j < V1->m; j++) {
-        for (Node* y = V1->Y[j]; y < V1->Y[j+1]; y++) {
-            const ImpLong i = y->idx;
-            y->val += inner( XS.data()+i*k, Q1.data()+j*k, k);
+    for (ImpLong t = 0; t < rows.size; t++) {
+        const ImpLong i = rows[t];
+        const ImpFloat *x1 = XS.data()+t*k;
+        axpy_k(x1, P1.data()+i*k, k, 1);
+        for (ImpLong s = UY.ptr[i], u = twin_ptr[f1][t]; s < UY.ptr[i+1]; s++, u++) {
+            const ImpLong j = UY.idx[s];
+            const ImpDouble v = inner(x1, Q1.data()+j*k, k);
+            UY.val[s] += v;
+            if (tw[u] < VY.nnz())
+                VY.val[tw[u]] += v;
         }
     }
+    add_sums(sub_type, c, rows, 1);
 }
 
 void ImpProblem::init() {
@@ -478,6 +1530,44 @@ void ImpProblem::init() {
 
     k = param->k;
 
+    if (!param->telemetry_path.empty() && mpi_rank() == 0)
+        tel = make_shared<Telemetry>(param->telemetry_path);
+
+    if (param->resume && ifstream(param->checkpoint_path).good()) {
+        epoch0 = load_prior(param->checkpoint_path);
+        cout << "resume from epoch " << epoch0 << endl;
+    }
+    else if (!param->warm_path.empty()) {
+        load_prior(param->warm_path);
+    }
+
+    // Out of core, the user rows, their residuals and their projections
+    // live in scratch files; a mapped cache is already backed by its file.
+    if (!param->ooc_path.empty()) {
+        set_disk_dir(param->ooc_path);
+        if (U->cache == nullptr)
+            for (CSR &X1 : U->Xs)
+                X1.to_disk();
+        U->Y.to_disk();
+    }
+    {
+        DiskScope disk(true);
+        U->transpose_fields();
+    }
+    V->transpose_fields();
+
+    // Under MPI each rank holds a part of the users, and with them their
+    // positives; items, W and H are replicated.
+    m_all = m;
+    sum_all(&m_all, 1);
+    nnz_u.resize(m);
+    nnz_v.resize(n);
+    for (ImpLong i = 0; i < m; i++)
+        nnz_u[i] = U->Y.ptr[i+1] - U->Y.ptr[i];
+    for (ImpLong j = 0; j < n; j++)
+        nnz_v[j] = V->Y.ptr[j+1] - V->Y.ptr[j];
+    sum_all(nnz_v.data(), n);
+
     a.resize(m, 0);
     b.resize(n, 0);
 
@@ -491,6 +1581,8 @@ void ImpProblem::init() {
 
     P.resize(nr_blocks);
     Q.resize(nr_blocks);
+    if (param->cg_warm)
+        S_last.assign(2*nr_blocks, Vec());
 
     for (ImpInt f1 = 0; f1 < f; f1++) {
         const shared_ptr<ImpData> d1 = ((f1<fu)? U: V);
@@ -505,18 +1597,258 @@ void ImpProblem::init() {
         }
     }
 
-    cache_sasb();
+    vector<Vec>().swap(W0);
+    vector<Vec>().swap(H0);
+    if (param->fold_in)
+        init_fold_in();
+
+    if (param->numa) {
+        vector<pair<const void*, size_t>> model, data;
+        for (const vector<Vec> *M : {&W, &H, &P, &Q})
+            for (const Vec &M1 : *M)
+                model.emplace_back(M1.data(), M1.size()*sizeof(ImpFloat));
+        auto add_csr = [&] (const CSR &X) {
+            data.emplace_back(X.ptr, (X.nr_rows+1)*sizeof(ImpLong));
+            data.emplace_back(X.idx, X.nnz()*sizeof(ImpIdx));
+            data.emplace_back(X.val, X.nnz()*sizeof(ImpFloat));
+        };
+        for (const shared_ptr<ImpData> &D : {U, V}) {
+            add_csr(D->Y);
+            for (ImpInt fi = 0; fi < D->f; fi++) {
+                add_csr(D->Xs[fi]);
+                add_csr(D->XTs[fi]);
+            }
+        }
+        cout << "numa: model " << numa_report(model) << ", data " << numa_report(data)
+            << "; huge pages " << thp_report() << endl;
+    }
+
+    // Row scratch of every thread, sized once.
+#pragma omp parallel
+    {
+        Workspace ws;
+        ws.vec(k);
+        ws.dvec(k*k);
+        ws.lvec(16*omp_get_max_threads()+1);
+    }
+
     if (param->self_side)
         calc_side();
+    if (param->fold_in)
+        init_sums();
+    cache_sasb();
     init_y_tilde();
 }
 
+// Fold-in keeps the rows of the warm-start model fixed and trains only the
+// rows of features it has not seen. Once P and Q are built, X is cut down to
+// the users and items with those features, so every sum over X skips the
+// rest and the gradient and Hessian vanish on the fixed rows. The sums over
+// a whole side that the cross steps need are kept in sums and moved by the
+// rows each step changes, so a step costs as much as the rows it visits.
+// Fields without new features are skipped.
+void ImpProblem::init_fold_in() {
+    U->restrict_fields(vector<ImpLong>(D0.begin(), D0.begin()+fu));
+    V->restrict_fields(vector<ImpLong>(D0.begin()+fu, D0.end()));
+    U->transpose_fields();
+    V->transpose_fields();
+
+    // A step then updates y~ of the positives of its rows only, on both
+    // copies of Y; init_y_tilde pairs them up the same way.
+    const CSR &UY = U->Y, &VY = V->Y;
+    vector<ImpLong> u2v(UY.nnz(), VY.nnz()), v2u(VY.nnz());
+    vector<ImpLong> next(VY.ptr, VY.ptr+n);
+    for (ImpLong i = 0; i < m; i++) {
+        for (ImpLong s = UY.ptr[i]; s < UY.ptr[i+1]; s++) {
+            const ImpLong j = UY.idx[s];
+            if (j < n) {
+                u2v[s] = next[j]++;
+                v2u[u2v[s]] = s;
+            }
+        }
+    }
+    twin_ptr.assign(f, vector<ImpLong>(1, 0));
+    twin.assign(f, vector<ImpLong>());
+    for (ImpInt f1 = 0; f1 < f; f1++) {
+        const CSR &Y = (f1 < fu)? UY: VY;
+        const vector<ImpLong> &map1 = (f1 < fu)? u2v: v2u;
+        for (const ImpLong i : (f1 < fu)? U->rows[f1]: V->rows[f1-fu]) {
+            twin[f1].insert(twin[f1].end(), map1.begin()+Y.ptr[i], map1.begin()+Y.ptr[i+1]);
+            twin_ptr[f1].push_back(twin[f1].size());
+        }
+    }
+
+    vector<ImpLong> nnz_new(f);
+    for (ImpInt f1 = 0; f1 < f; f1++)
+        nnz_new[f1] = (f1 < fu)? U->Xs[f1].nnz(): V->Xs[f1-fu].nnz();
+    sum_all(nnz_new.data(), f);
+    frozen.resize(f);
+    for (ImpInt f1 = 0; f1 < f; f1++)
+        frozen[f1] = (nnz_new[f1] == 0);
+}
+
+// Rows of field f1 a step visits: all rows, or under fold-in those with
+// new features, in the order of its compact X.
+RowSet ImpProblem::rows_of(const ImpInt f1) const {
+    const shared_ptr<ImpData> U1 = (f1 < fu)? U: V;
+    const ImpInt fi = (f1 < fu)? f1: f1-fu;
+    RowSet rows;
+    rows.size = U1->Xs[fi].nr_rows;
+    if (param->fold_in)
+        rows.ids = U1->rows[fi].data();
+    return rows;
+}
+
+// Position of cross block f12 in fu*fv order.
+ImpInt ImpProblem::cross_index(const ImpInt f12) const {
+    for (ImpInt al = 0; al < fu; al++)
+        for (ImpInt be = fu; be < f; be++)
+            if (index_vec(al, be, f) == f12)
+                return al*fv+be-fu;
+    return 0;
+}
+
+void ImpProblem::init_sums() {
+    const ImpInt nc = fu*fv;
+    for (ImpInt side = 0; side < 2; side++) {
+        const bool user_rows = (side == 0);
+        SideSums &S = sums[side];
+        S.gram.assign(nc*nc, vector<ImpDouble>(k*k, 0));
+        S.o.assign(nc, vector<ImpDouble>(k, 0));
+        S.so.assign(nc, vector<ImpDouble>(k, 0));
+        const Vec &a1 = (user_rows)? a: b;
+        S.self = sum(a1);
+        RowSet all;
+        all.size = (user_rows)? m: n;
+        for (ImpInt c = 0; c < nc; c++)
+            add_sums(user_rows, c, all, 1, c);
+    }
+}
+
+// Adds sign times the terms of the given rows of cross block c to the sums
+// of its side, pairing c with the blocks from e0 on.
+void ImpProblem::add_sums(const bool user_rows, const ImpInt c, const RowSet &rows,
+        const ImpDouble sign, const ImpInt e0) {
+    SideSums &S = sums[(user_rows)? 0: 1];
+    const ImpInt nc = fu*fv;
+    const vector<Vec> &Xs = (user_rows)? P: Q;
+    const Vec &a1 = (user_rows)? a: b;
+    const auto block = [&] (const ImpInt e) -> const Vec& {
+        return Xs[index_vec(e/fv, fu+e%fv, f)];
+    };
+
+    Workspace ws;
+    const bool compact = (rows.ids != nullptr);
+    Vec &A = ws.vec((compact)? rows.size*k: 0, 0, user_rows);
+    Vec &B = ws.vec((compact)? rows.size*k: 0, 0, user_rows);
+    Vec &G = ws.vec(k*k);
+    const auto gather = [&] (const Vec &X1, Vec &Xr) {
+    #pragma omp parallel for schedule(static)
+        for (ImpLong t = 0; t < rows.size; t++)
+            copy(X1.data()+rows[t]*k, X1.data()+(rows[t]+1)*k, Xr.data()+t*k);
+    };
+    if (compact)
+        gather(block(c), A);
+    const ImpFloat *xc = (compact)? A.data(): block(c).data();
+
+    for (ImpInt e = e0; e < nc; e++) {
+        const ImpFloat *xe = xc;
+        if (e != c) {
+            if (compact)
+                gather(block(e), B);
+            xe = (compact)? B.data(): block(e).data();
+        }
+        mm(xc, xe, G.data(), k, rows.size);
+        vector<ImpDouble> &g1 = S.gram[c*nc+e], &g2 = S.gram[e*nc+c];
+        for (ImpInt d1 = 0; d1 < k; d1++)
+            for (ImpInt d2 = 0; d2 < k; d2++) {
+                g1[d1*k+d2] += sign*G[d1*k+d2];
+                if (e != c)
+                    g2[d2*k+d1] += sign*G[d1*k+d2];
+            }
+    }
+
+    vector<ImpDouble> &o = S.o[c], &so = S.so[c];
+    #pragma omp parallel
+    {
+        Workspace ws_t;
+        vector<ImpDouble> &acc = ws_t.dvec(2*k);
+    #pragma omp for schedule(static)
+        for (ImpLong t = 0; t < rows.size; t++) {
+            const ImpLong i = rows[t];
+            const ImpFloat *x1 = xc+t*k;
+            for (ImpInt d = 0; d < k; d++) {
+                acc[d] += x1[d];
+                acc[k+d] += a1[i]*x1[d];
+            }
+        }
+    #pragma omp critical
+        for (ImpInt d = 0; d < k; d++) {
+            o[d] += sign*acc[d];
+            so[d] += sign*acc[k+d];
+        }
+    }
+}
+
+ImpProblem::~ImpProblem() {
+    if (ckpt_writer.joinable())
+        ckpt_writer.join();
+}
+
+// Reads W and H of an earlier model, text or binary, into W0 and H0 and
+// widens the fields to its rows. Returns the epochs it was trained for.
+ImpInt ImpProblem::load_prior(const string &path) {
+    shared_ptr<ImpData> U0 = make_shared<ImpData>(""), V0 = make_shared<ImpData>("");
+    shared_ptr<ImpData> Uva0 = make_shared<ImpData>("");
+    shared_ptr<Parameter> param0 = make_shared<Parameter>(*param);
+    ImpProblem prior(U0, Uva0, V0, param0);
+    string model_path = path;
+    load_model(prior, model_path);
+    if (prior.qbytes > 0)
+        throw invalid_argument(path + " is a quantized model and cannot be trained");
+    if (prior.fu != fu || prior.fv != fv || prior.k != k)
+        throw invalid_argument(path + ": fields or rank differ from the data");
+    if (prior.model_hash_bits() != model_hash_bits())
+        throw invalid_argument(path + ": hashed fields differ from the data");
+
+    U->grow_fields(U0->Ds);
+    V->grow_fields(V0->Ds);
+
+    D0.assign(U0->Ds.begin(), U0->Ds.end());
+    D0.insert(D0.end(), V0->Ds.begin(), V0->Ds.end());
+
+    const ImpInt nr_blocks = f*(f+1)/2;
+    const bool mapped = !prior.Wm.empty();
+    W0.assign(nr_blocks, Vec());
+    H0.assign(nr_blocks, Vec());
+    for (ImpInt f1 = 0; f1 < f; f1++) {
+        const ImpLong D1 = (f1 < fu)? U0->Ds[f1]: V0->Ds[f1-fu];
+        for (ImpInt f2 = f1; f2 < f; f2++) {
+            const ImpLong D2 = (f2 < fu)? U0->Ds[f2]: V0->Ds[f2-fu];
+            const ImpInt f12 = index_vec(f1, f2, f);
+            if (mapped? prior.Wm[f12] == nullptr: prior.W[f12].empty())
+                continue;
+            const ImpFloat *w = mapped? prior.Wm[f12]: prior.W[f12].data();
+            const ImpFloat *h = mapped? prior.Hm[f12]: prior.H[f12].data();
+            W0[f12].assign(w, w+D1*k);
+            H0[f12].assign(h, h+D2*k);
+        }
+    }
+    return prior.epoch0;
+}
+
 void ImpProblem::cache_sasb() {
+    KernelTimer timer(tel, "cache_sasb", 2*fu*fv*(m+n)*k*sizeof(ImpFloat));
+    if (param->fold_in) {
+        cache_sasb_rows();
+        return;
+    }
     fill(sa.begin(), sa.end(), 0);
     fill(sb.begin(), sb.end(), 0);
 
-    const Vec o1(m, 1), o2(n, 1);
-    Vec tk(k);
+    Workspace ws;
+    const Vec &o1 = ws.vec(m, 1, true), &o2 = ws.vec(n, 1);
+    Vec &tk = ws.vec(k);
 
     for (ImpInt f1 = 0; f1 < fu; f1++) {
         for (ImpInt f2 = fu; f2 < f; f2++) {
@@ -529,104 +1861,179 @@ void ImpProblem::cache_sasb() {
 
             fill(tk.begin(), tk.end(), 0);
             mv(P1.data(), o1.data(), tk.data(), m, k, 0, true);
+            sum_all(tk.data(), k);
             mv(Q1.data(), tk.data(), sb.data(), n, k, 1, false);
         }
     }
 }
 
+// Fold-in reads sa and sb on the rows with new features only, and takes
+// the column sums of the other side from sums.
+void ImpProblem::cache_sasb_rows() {
+    const ImpInt nc = fu*fv;
+    Workspace ws;
+    Vec &oP = ws.vec(nc*k), &oQ = ws.vec(nc*k);
+    for (ImpInt c = 0; c < nc; c++) {
+        copy(sums[0].o[c].begin(), sums[0].o[c].end(), oP.begin()+c*k);
+        copy(sums[1].o[c].begin(), sums[1].o[c].end(), oQ.begin()+c*k);
+    }
+    sum_all(oP.data(), nc*k);
+
+    for (ImpInt f1 = 0; f1 < f; f1++) {
+        const bool user_rows = f1 < fu;
+        const RowSet rows = rows_of(f1);
+        const vector<Vec> &Xs = (user_rows)? P: Q;
+        const ImpFloat *o2 = (user_rows)? oQ.data(): oP.data();
+        Vec &s1 = (user_rows)? sa: sb;
+    #pragma omp parallel for schedule(guided)
+        for (ImpLong t = 0; t < rows.size; t++) {
+            const ImpLong i = rows[t];
+            ImpDouble v = 0;
+            for (ImpInt c = 0; c < nc; c++)
+                v += inner(Xs[index_vec(c/fv, fu+c%fv, f)].data()+i*k, o2+c*k, k);
+            s1[i] = v;
+        }
+    }
+}
+
+// G += lambda*W1, weighted by feature frequency under --freq. Sums into
+// user features are split over ranks, so only rank 0 adds it there. Rows
+// fixed by fold-in get none.
+void ImpProblem::add_reg(const ImpInt &f1, const Vec &W1, Vec &G) {
+    if (f1 < fu && mpi_rank() != 0)
+        return;
+    const ImpLong i0 = (param->fold_in)? D0[f1]: 0;
+    if(param->freq){
+        const shared_ptr<ImpData> U1 = (f1 < fu)? U:V;
+        const vector<ImpLong> &freq = U1->freq[(f1 < fu)? f1: f1-fu];
+        assert( W1.size() == freq.size()*k);
+        for(ImpLong i = i0; i < ImpLong(freq.size()); i++)
+            axpy( W1.data()+i*k, G.data()+i*k, k, lambda * ImpDouble(freq[i]));
+    }
+    else{
+        axpy( W1.data()+i0*k, G.data()+i0*k, G.size()-i0*k, lambda);
+    }
+}
+
+// Out-of-core form of the sums over the positives of item rows: C_j +=
+// coef(y, i, j)*p_i over the positives (i, j) with value y. Users are walked
+// in chunks, in order, so P1 streams from disk while the next chunk is
+// prefetched. Within a chunk threads split the items and read their
+// positives from V->Y, which lists them in user order, so each positive is
+// read once; next[j] is where item j resumes in the next chunk.
+template <typename F>
+void ImpProblem::scatter_items(const Vec &P1, const F &coef, Vec &C) {
+    const CSR &Y = V->Y;
+    const ImpFloat *pp = P1.data();
+    ImpFloat *cp = C.data();
+    Workspace ws;
+    vector<ImpLong> &next = ws.lvec(n);
+    copy(Y.ptr, Y.ptr+n, next.begin());
+    for (ImpLong i0 = 0; i0 < m; i0 += DISK_CHUNK) {
+        const ImpLong i1 = min(m, i0+DISK_CHUNK), i2 = min(m, i1+DISK_CHUNK);
+        prefetch(pp+i1*k, (i2-i1)*k*sizeof(ImpFloat));
+#pragma omp parallel for schedule(guided)
+        for (ImpLong j = 0; j < n; j++) {
+            ImpFloat *c1 = cp+j*k;
+            ImpLong s = next[j];
+            for (; s < Y.ptr[j+1] && Y.idx[s] < i1; s++) {
+                const ImpLong i = Y.idx[s];
+                const ImpDouble scale = coef(Y.val[s], i, j);
+                const ImpFloat *p1 = pp+i*k;
+                for (ImpInt d = 0; d < k; d++)
+                    c1[d] += scale*p1[d];
+            }
+            next[j] = s;
+        }
+    }
+}
+
 void ImpProblem::gd_side(const ImpInt &f1, const Vec &W1, const Vec &Q1, Vec &G) {
 
     const shared_ptr<ImpData> U1 = (f1 < fu)? U:V;
-    const vector<Node*> &Y = U1->Y;
+    const CSR &Y = U1->Y;
 
     const ImpInt base = (f1 < fu)? 0: fu;
     const ImpInt fi = f1-base;
-    const vector<Node*> &X = U1->Xs[fi];
+    const CSR &X = U1->Xs[fi];
+    const RowSet rows = rows_of(f1);
 
-    const ImpLong m1 = (f1 < fu)? m:n;
-    const ImpLong n1 = (f1 < fu)? n:m;
+    const ImpLong n1 = (f1 < fu)? n:m_all;
 
     const Vec &a1 = (f1 < fu)? a:b;
     const Vec &b1 = (f1 < fu)? b:a;
-    const ImpDouble b_sum = sum(b1);
+    ImpDouble b_sum = (param->fold_in)? sums[(f1 < fu)? 1: 0].self: sum(b1);
 
     const Vec &sa1 = (f1 < fu)? sa:sb;
 
-    const ImpLong block_size = G.size();
-    const ImpInt nr_threads = param->nr_threads;
-    Vec G_(nr_threads*block_size, 0);
+    Workspace ws;
+    Vec &C = ws.vec(rows.size*k, 0, f1 < fu);
+    KernelTimer timer(tel, "gd_side", nr_bytes(X)+nr_bytes(U1->XTs[fi])+nr_bytes(Y)
+            +nr_bytes(Q1)+nr_bytes(C)+2*nr_bytes(G));
+    const ImpFloat *qp = Q1.data();
 
-    const ImpDouble *qp = Q1.data();
-
-    if(param->freq){
-        const vector<ImpLong> &freq = U1->freq[fi];
-        const ImpLong df1 = U1->Ds[fi];
-        assert( df1 == freq.size());
-        for(ImpLong i = 0; i < df1; i++)
-            axpy( W1.data()+i*k, G.data()+i*k, k, lambda * ImpDouble(freq[i]));
+    // Positives of item rows are split over ranks, as are the sums into G for
+    // user rows.
+    vector<ImpDouble> &zy = ws.dvec(rows.size);
+    #pragma omp parallel for schedule(guided)
+    for (ImpLong t = 0; t < rows.size; t++) {
+        if (X.ptr[t] == X.ptr[t+1])
+            continue;
+        const ImpLong i = rows[t];
+        for (ImpLong s = Y.ptr[i]; s < Y.ptr[i+1]; s++)
+            zy[t] += (1-w)*Y.val[s]-w*(1-r);
     }
-    else{
-        axpy( W1.data(), G.data(), G.size(), lambda);
+    if (f1 >= fu) {
+        sum_all(&b_sum, 1);
+        sum_all(zy.data(), rows.size);
     }
 
+    add_reg(f1, W1, G);
+
     #pragma omp parallel for schedule(guided)
-    for (ImpLong i = 0; i < m1; i++) {
-        const ImpInt id = omp_get_thread_num();
-        const ImpDouble *q1 = qp+i*k;
-        ImpDouble z_i = w*(n1*(a1[i]-r)+b_sum+sa1[i]);
-        for (Node* y = Y[i]; y < Y[i+1]; y++) {
-            const ImpDouble y_tilde = y->val;
-            z_i += (1-w)*y_tilde-w*(1-r);
-        }
-        for (Node* x = X[i]; x < X[i+1]; x++) {
-            const ImpLong idx = x->idx;
-            const ImpDouble val = x->val;
-            for (ImpInt d = 0; d < k; d++) {
-                const ImpLong jd = idx*k+d;
-                G_[jd+id*block_size] += q1[d]*val*z_i;
-            }
-        }
+    for (ImpLong t = 0; t < rows.size; t++) {
+        if (X.ptr[t] == X.ptr[t+1])
+            continue;
+        const ImpLong i = rows[t];
+        const ImpFloat *q1 = qp+i*k;
+        ImpFloat *c1 = C.data()+t*k;
+        const ImpDouble z_i = w*(n1*(a1[i]-r)+b_sum+sa1[i]) + zy[t];
+        for (ImpInt d = 0; d < k; d++)
+            c1[d] = q1[d]*z_i;
     }
-    for(ImpInt i = 0; i < nr_threads; i++)
-        axpy(G_.data()+i*block_size, G.data(), block_size, 1);
+    XTC(U1->XTs[fi], C, G);
+    if (f1 < fu)
+        sum_all(G.data(), G.size());
 }
 
-void ImpProblem::hs_side(const ImpLong &m1, const ImpLong &n1,
-        const Vec &V, Vec &Hv, const Vec &Q1, const vector<Node*> &UX,
-        const vector<Node*> &Y, Vec &Hv_) {
+void ImpProblem::hs_side(const RowSet &rows, const ImpLong &n1,
+        const Vec &V, Vec &Hv, const Vec &Q1, const CSR &UX,
+        const CSR &UXT, const vector<ImpLong> &nnz1, Vec &C) {
+    KernelTimer timer(tel, "hs_side", nr_bytes(UX)+nr_bytes(UXT)+nr_bytes(Q1)
+            +nr_bytes(C)+nr_bytes(V)+nr_bytes(Hv));
 
-    const ImpDouble *qp = Q1.data();
-    const ImpInt nr_threads = param->nr_threads;
-
-    const ImpLong block_size = Hv.size();
+    const ImpFloat *qp = Q1.data();
 
     #pragma omp parallel for schedule(guided)
-        for (ImpLong i = 0; i < m1; i++) {
-            ImpInt id = omp_get_thread_num();
-            const ImpDouble* q1 = qp+i*k;
-            ImpDouble d_1 = (1-w)*ImpInt(Y[i+1] - Y[i]) + w*n1;
-            ImpDouble z_1 = 0;
-            for (Node* x = UX[i]; x < UX[i+1]; x++) {
-                const ImpLong idx = x->idx;
-                const ImpDouble val = x->val;
-                for (ImpInt d = 0; d < k; d++)
-                    z_1 += q1[d]*val*V[idx*k+d];
-            }
-            z_1 *= d_1;
-            for (Node* x = UX[i]; x < UX[i+1]; x++) {
-                const ImpLong idx = x->idx;
-                const ImpDouble val = x->val;
-                for (ImpInt d = 0; d < k; d++) {
-                    const ImpLong jd = idx*k+d;
-                    Hv_[jd+block_size*id] += q1[d]*val*z_1;
-                }
-            }
+        for (ImpLong t = 0; t < rows.size; t++) {
+            if (UX.ptr[t] == UX.ptr[t+1])
+                continue;
+            const ImpLong i = rows[t];
+            const ImpFloat* q1 = qp+i*k;
+            ImpFloat *c1 = C.data()+t*k;
+            ImpDouble d_1 = (1-w)*ImpInt(nnz1[i]) + w*n1;
+            fill(c1, c1+k, 0);
+            UTx(UX, t, V.data(), c1);
+            const ImpDouble z_1 = d_1*dot_k(q1, c1, k);
+            for (ImpInt d = 0; d < k; d++)
+                c1[d] = q1[d]*z_1;
         }
 
-    for(ImpInt i = 0; i < nr_threads; i++)
-        axpy(Hv_.data()+i*block_size, Hv.data(), block_size, 1);
+    XTC(UXT, C, Hv);
 }
 
+// Under fold-in the sums over the other side come from sums, so the step
+// reads the rows with new features only.
 void ImpProblem::gd_cross(const ImpInt &f1, const ImpInt &f12, const Vec &Q1, const Vec &W1,Vec &G) {
 
 
@@ -641,212 +2048,428 @@ void ImpProblem::gd_cross(const ImpInt &f1, const ImpInt &f12, const Vec &Q1, co
 
     const shared_ptr<ImpData> U1 = (f1 < fu)? U:V;
     const ImpInt fi = (f1 < fu)? f1 : f1 - fu;
-    const vector<Node*> &X = U1->Xs[fi];
-    const vector<Node*> &Y = U1->Y;
-
-    if(param->freq){
-        vector<ImpLong> &freq = U1->freq[fi];
-        const ImpLong df1 = U1->Ds[fi];
-        assert( df1 == freq.size());
-        for(ImpLong i = 0; i < df1; i++)
-            axpy( W1.data()+i*k, G.data()+i*k, k, lambda * ImpDouble(freq[i]));
+    const CSR &X = U1->Xs[fi];
+    const CSR &Y = U1->Y;
+    const RowSet rows = rows_of(f1);
+    const ImpInt nc = fu*fv;
+    const SideSums &S2 = sums[(f1 < fu)? 1: 0];
+    const ImpInt c1 = (param->fold_in)? cross_index(f12): 0;
+
+    add_reg(f1, W1, G);
+
+    // Each (al, be) pair reads a Qa and a Pa shaped like Q1 and T.
+    KernelTimer timer(tel, "gd_cross", nr_bytes(X)+nr_bytes(U1->XTs[fi])+nr_bytes(Y)
+            +(fu*fv+1)*nr_bytes(Q1)+(fu*fv+2)*m1*k*sizeof(ImpFloat)+2*nr_bytes(G));
+
+    Workspace ws;
+    Vec &QTQ = ws.vec(k*k), &oQ = ws.vec(k), &bQ = ws.vec(k);
+    Vec &T = ws.vec(rows.size*k, 0, f1 < fu);
+
+    // For item rows, Q1 holds this rank's users: the sums over them are
+    // split over ranks, as are the positives of each item.
+    if (param->fold_in) {
+        copy(S2.o[c1].begin(), S2.o[c1].end(), oQ.begin());
+        copy(S2.so[c1].begin(), S2.so[c1].end(), bQ.begin());
     }
-    else{
-        axpy( W1.data(), G.data(), G.size(), lambda);
+    else {
+        const Vec &o1 = ws.vec(n1, 1, f1 >= fu);
+        mv(Q1.data(), o1.data(), oQ.data(), n1, k, 0, true);
+        mv(Q1.data(), b1.data(), bQ.data(), n1, k, 0, true);
+    }
+    if (f1 >= fu) {
+        sum_all(oQ.data(), k);
+        sum_all(bQ.data(), k);
     }
-
-    Vec QTQ(k*k, 0), T(m1*k, 0), o1(n1, 1), oQ(k, 0), bQ(k, 0);
-
-    mv(Q1.data(), o1.data(), oQ.data(), n1, k, 0, true);
-    mv(Q1.data(), b1.data(), bQ.data(), n1, k, 0, true);
 
     for (ImpInt al = 0; al < fu; al++) {
         for (ImpInt be = fu; be < f; be++) {
             const ImpInt fab = index_vec(al, be, f);
             const Vec &Qa = Qs[fab], &Pa = Ps[fab];
-            mm(Qa.data(), Q1.data(), QTQ.data(), k, n1);
-            mm(Pa.data(), QTQ.data(), T.data(), m1, k, k, 1);
+            if (param->fold_in) {
+                const vector<ImpDouble> &g = S2.gram[(al*fv+be-fu)*nc+c1];
+                copy(g.begin(), g.end(), QTQ.begin());
+            }
+            else
+                mm(Qa.data(), Q1.data(), QTQ.data(), k, n1);
+            if (f1 >= fu)
+                sum_all(QTQ.data(), k*k);
+            // T += Pa*QTQ, on the rows with features in this field only.
+            const ImpFloat *pa = Pa.data();
+            #pragma omp parallel for schedule(guided)
+            for (ImpLong t = 0; t < rows.size; t++) {
+                if (X.ptr[t] == X.ptr[t+1])
+                    continue;
+                const ImpLong i = rows[t];
+                for (ImpInt d = 0; d < k; d++)
+                    axpy_k(QTQ.data()+d*k, T.data()+t*k, k, pa[i*k+d]);
+            }
         }
     }
 
-    const ImpLong block_size = G.size();
-    const ImpInt nr_threads = param->nr_threads;
-    Vec G_(nr_threads*block_size, 0);
+    Vec &C = ws.vec(rows.size*k, 0, f1 < fu);
+    const ImpFloat *tp = T.data(), *qp = Q1.data();
 
-    const ImpDouble *tp = T.data(), *qp = Q1.data();
-
-    #pragma omp parallel for schedule(guided)
-    for (ImpLong i = 0; i < m1; i++) {
-        Vec pk(k, 0);
-        const ImpInt id = omp_get_thread_num();
-        const ImpDouble *t1 = tp+i*k;
-        for (Node* y = Y[i]; y < Y[i+1]; y++) {
-            const ImpDouble scale = (1-w)*y->val-w*(1-r);
-            const ImpLong j = y->idx;
-            const ImpDouble *q1 = qp+j*k;
-            for (ImpInt d = 0; d < k; d++)
-                pk[d] += scale*q1[d];
+    if (f1 >= fu && !param->ooc_path.empty() && !param->fold_in) {
+        scatter_items(Q1, [&] (const ImpFloat y, const ImpLong i, const ImpLong j) {
+            return (1-w)*y-w*(1-r);
+        }, C);
+    }
+    else {
+        #pragma omp parallel for schedule(guided)
+        for (ImpLong t = 0; t < rows.size; t++) {
+            if (X.ptr[t] == X.ptr[t+1])
+                continue;
+            const ImpLong i = rows[t];
+            gather_k(Y.idx, [&] (const ImpLong s) { return (1-w)*Y.val[s]-w*(1-r); },
+                    Y.ptr[i], Y.ptr[i+1], qp, C.data()+t*k, k);
         }
+    }
+    if (f1 >= fu)
+        sum_all(C.data(), C.size());
 
-        const ImpDouble z_i = a1[i]-r;
-        for (Node* x = X[i]; x < X[i+1]; x++) {
-            const ImpLong idx = x->idx;
-            const ImpDouble val = x->val;
-            for (ImpInt d = 0; d < k; d++) {
-                const ImpLong jd = idx*k+d;
-                G_[jd+id*block_size] += (pk[d]+w*(t1[d]+z_i*oQ[d]+bQ[d]))*val;
-            }
-        }
+    #pragma omp parallel for schedule(guided)
+    for (ImpLong t = 0; t < rows.size; t++) {
+        if (X.ptr[t] == X.ptr[t+1])
+            continue;
+        const ImpFloat *t1 = tp+t*k;
+        ImpFloat *c1 = C.data()+t*k;
+        const ImpDouble z_i = a1[rows[t]]-r;
+        for (ImpInt d = 0; d < k; d++)
+            c1[d] += w*(t1[d]+z_i*oQ[d]+bQ[d]);
     }
-    for(ImpInt i = 0; i < nr_threads; i++)
-        axpy(G_.data()+i*block_size, G.data(), block_size, 1);
+    XTC(U1->XTs[fi], C, G);
+    if (f1 < fu)
+        sum_all(G.data(), G.size());
 }
 
 
-void ImpProblem::hs_cross(const ImpLong &m1, const ImpLong &n1, const Vec &V,
-        const Vec &VQTQ, Vec &Hv, const Vec &Q1,
-        const vector<Node*> &X, const vector<Node*> &Y, Vec &Hv_) {
+void ImpProblem::hs_cross(const RowSet &rows, const Vec &V,
+        const Vec &VQTQ, Vec &Hv, const Vec &Q1, const CSR &X,
+        const CSR &XT, const CSR &Y, const bool item_rows, Vec &C) {
+    KernelTimer timer(tel, "hs_cross", nr_bytes(X)+nr_bytes(XT)+nr_bytes(Y)+nr_bytes(Q1)
+            +nr_bytes(C)+nr_bytes(V)+nr_bytes(VQTQ)+nr_bytes(Hv));
 
-    const ImpDouble *qp = Q1.data();
+    const ImpFloat *qp = Q1.data();
 
-    const ImpLong block_size = Hv.size();
-    const ImpInt nr_threads = param->nr_threads;
+    if (item_rows && !param->ooc_path.empty() && !param->fold_in) {
+        Workspace ws;
+        Vec &Phi = ws.vec(rows.size*k, 0, true);
+        fill(C.begin(), C.end(), 0);
+    #pragma omp parallel for schedule(guided)
+        for (ImpLong i = 0; i < rows.size; i++)
+            UTx(X, i, V.data(), Phi.data()+i*k);
+        scatter_items(Q1, [&] (const ImpFloat y, const ImpLong i, const ImpLong j) {
+            return inner(Phi.data()+j*k, qp+i*k, k);
+        }, C);
+        scal(C.data(), C.size(), 1-w);
+    }
+    else {
+    #pragma omp parallel
+        {
+            Workspace ws_t;
+            Vec &phi = ws_t.vec(k);
+    #pragma omp for schedule(guided)
+            for (ImpLong t = 0; t < rows.size; t++) {
+                if (X.ptr[t] == X.ptr[t+1])
+                    continue;
+                const ImpLong i = rows[t];
+                ImpFloat *c1 = C.data()+t*k;
+                fill(phi.begin(), phi.end(), 0);
+                UTx(X, t, V.data(), phi.data());
+
+                fill(c1, c1+k, 0);
+                gather_k(Y.idx, [&] (const ImpLong s) {
+                    return (1-w)*dot_k(phi.data(), qp+Y.idx[s]*k, k);
+                }, Y.ptr[i], Y.ptr[i+1], qp, c1, k);
+            }
+        }
+    }
+    // The positives of an item are split over ranks.
+    if (item_rows)
+        sum_all(C.data(), rows.size*k);
+
+    #pragma omp parallel
+    {
+        Workspace ws_t;
+        Vec &tau = ws_t.vec(k);
+    #pragma omp for schedule(guided)
+        for (ImpLong t = 0; t < rows.size; t++) {
+            if (X.ptr[t] == X.ptr[t+1])
+                continue;
+            ImpFloat *c1 = C.data()+t*k;
+            fill(tau.begin(), tau.end(), 0);
+            UTx(X, t, VQTQ.data(), tau.data());
+            for (ImpInt d = 0; d < k; d++)
+                c1[d] += w*tau[d];
+        }
+    }
+
+    XTC(XT, C, Hv);
+}
 
+// Inverse diagonal of the Hessian of a block, exact for both kinds of
+// block. For a cross block each row takes the squares of the other side's
+// rows over its positives, which costs about as much as a gradient.
+void ImpProblem::precond(const ImpInt &f1, const ImpInt &f2, const Vec &Q1,
+        const Vec &QTQ, Vec &M) {
+    KernelTimer timer(tel, "precond", nr_bytes(Q1));
+    const bool user_rows = f1 < fu;
+    const shared_ptr<ImpData> U1 = (user_rows)? U:V;
+    const ImpInt fi = (user_rows)? f1: f1-fu;
+    const CSR &XT = U1->XTs[fi];
+    const vector<ImpLong> &nnz1 = (user_rows)? nnz_u: nnz_v;
+    const RowSet rows = rows_of(f1);
+    const ImpLong Df1 = U1->Ds[fi];
+    Workspace ws;
+    vector<ImpDouble> &D = ws.dvec(Df1*k);
+
+    if (user_rows == (f2 < fu)) {
+        const ImpLong n1_all = (user_rows)? n: m_all;
     #pragma omp parallel for schedule(guided)
-        for (ImpLong i = 0; i < m1; i++) {
-            const ImpInt id = omp_get_thread_num();
-            Vec tau(k, 0), phi(k, 0), ka(k, 0);
-            UTx(X[i], X[i+1], V, phi.data());
-            UTx(X[i], X[i+1], VQTQ, tau.data());
-
-            for (Node* y = Y[i]; y < Y[i+1]; y++) {
-                const ImpLong idx = y->idx;
-                const ImpDouble *dp = qp + idx*k;
-                const ImpDouble val = inner(phi.data(), dp, k);
+        for (ImpLong j = 0; j < Df1; j++) {
+            ImpDouble *d1 = D.data()+j*k;
+            for (ImpLong s = XT.ptr[j]; s < XT.ptr[j+1]; s++) {
+                const ImpLong i = rows[XT.idx[s]];
+                const ImpDouble val = XT.val[s];
+                const ImpDouble coef = val*val*((1-w)*ImpInt(nnz1[i]) + w*n1_all);
+                const ImpFloat *q1 = Q1.data()+i*k;
                 for (ImpInt d = 0; d < k; d++)
-                    ka[d] += val*dp[d];
+                    d1[d] += coef*q1[d]*q1[d];
             }
-
-            for (Node* x = X[i]; x < X[i+1]; x++) {
-                const ImpLong idx = x->idx;
-                const ImpDouble val = x->val;
-                for (ImpInt d = 0; d < k; d++) {
-                    const ImpLong jd = idx*k+d;
-                    Hv_[jd+id*block_size] += ((1-w)*ka[d]+w*tau[d])*val;
+        }
+    }
+    else {
+        // The positives of an item are split over ranks.
+        const CSR &Y = U1->Y;
+        const ImpFloat *qp = Q1.data();
+        Vec &E = ws.vec(rows.size*k, 0, user_rows);
+        if (!user_rows && !param->ooc_path.empty() && !param->fold_in) {
+            Vec &Q2 = ws.vec(Q1.size(), 0, true);
+    #pragma omp parallel for schedule(static)
+            for (ImpLong id = 0; id < ImpLong(Q1.size()); id++)
+                Q2[id] = qp[id]*qp[id];
+            scatter_items(Q2, [] (const ImpFloat y, const ImpLong i, const ImpLong j) {
+                return 1.0;
+            }, E);
+        }
+        else {
+    #pragma omp parallel for schedule(guided)
+            for (ImpLong t = 0; t < rows.size; t++) {
+                const ImpLong i = rows[t];
+                ImpFloat *e1 = E.data()+t*k;
+                for (ImpLong s = Y.ptr[i]; s < Y.ptr[i+1]; s++) {
+                    const ImpFloat *q1 = qp+Y.idx[s]*k;
+                    for (ImpInt d = 0; d < k; d++)
+                        e1[d] += q1[d]*q1[d];
                 }
             }
         }
+        if (!user_rows)
+            sum_all(E.data(), E.size());
+
+    #pragma omp parallel for schedule(guided)
+        for (ImpLong j = 0; j < Df1; j++) {
+            ImpDouble *d1 = D.data()+j*k;
+            for (ImpLong s = XT.ptr[j]; s < XT.ptr[j+1]; s++) {
+                const ImpDouble val = XT.val[s];
+                const ImpFloat *e1 = E.data()+XT.idx[s]*k;
+                for (ImpInt d = 0; d < k; d++)
+                    d1[d] += val*val*(w*QTQ[d*k+d] + (1-w)*e1[d]);
+            }
+        }
+    }
+    if (user_rows)
+        sum_all(D.data(), Df1*k);
 
-    for(ImpInt i = 0; i < nr_threads; i++)
-        axpy(Hv_.data()+i*block_size, Hv.data(), block_size, 1);
+    const ImpLong i0 = (param->fold_in)? D0[f1]: 0;
+    const vector<ImpLong> &freq = U1->freq[fi];
+    ImpDouble mean = 0;
+    for (ImpLong j = 0; j < Df1; j++)
+        for (ImpInt d = 0; d < k; d++) {
+            ImpDouble &djd = D[j*k+d];
+            if (j >= i0)
+                djd += (param->freq)? lambda*ImpDouble(freq[j]): lambda;
+            mean += djd;
+        }
+    mean /= max(Df1*k, ImpLong(1));
+
+    const ImpDouble shift = param->precond_shift*mean;
+    M.resize(Df1*k);
+    for (ImpLong j = 0; j < Df1*k; j++) {
+        const ImpDouble djd = D[j] + shift;
+        M[j] = (djd > 0)? 1/djd: 1;
+    }
 }
 
-void ImpProblem::cg(const ImpInt &f1, const ImpInt &f2, Vec &S1,
+// Solves H S1 = -G by conjugate gradient, optionally preconditioned by the
+// Hessian diagonal and started from the last step of the same block side.
+void ImpProblem::cg(const ImpInt &f1, const ImpInt &f2, const bool second, Vec &S1,
         const Vec &Q1, const Vec &G, Vec &P1) {
 
     const ImpInt base = (f1 < fu)? 0: fu;
     const ImpInt fi = f1-base;
 
     const shared_ptr<ImpData> U1 = (f1 < fu)? U:V;
-    const vector<Node*> &Y = U1->Y;
-    const vector<Node*> &X = U1->Xs[fi];
+    const CSR &Y = U1->Y;
+    const CSR &X = U1->Xs[fi], &XT = U1->XTs[fi];
 
-    const ImpLong m1 = (f1 < fu)? m:n;
     const ImpLong n1 = (f1 < fu)? n:m;
+    const ImpLong n1_all = (f1 < fu)? n:m_all;
+    const RowSet rows = rows_of(f1);
 
+    // Under fold-in the rows of the model it started from stay put.
     const ImpLong Df1 = U1->Ds[fi], Df1k = Df1*k;
-    const ImpInt nr_threads = param->nr_threads;
-    Vec Hv_(nr_threads*Df1k);
+    const ImpLong o = (param->fold_in)? D0[f1]*k: 0, len = Df1k-o;
+    Workspace ws;
+    Vec &C = ws.vec(rows.size*k, 0, f1 < fu);
 
-    ImpInt nr_cg = 0, max_cg = 20;
-    ImpDouble g2 = 0, r2, cg_eps = 9e-2, alpha = 0, beta = 0, gamma = 0, vHv;
+    const ImpInt max_cg = param->max_cg;
+    const ImpDouble cg_eps = param->cg_eps;
+    ImpInt nr_cg = 0;
+    ImpDouble g2 = 0, r2, rz, alpha = 0, beta = 0, gamma = 0, vHv;
 
-    Vec V(Df1k, 0), R(Df1k, 0), Hv(Df1k, 0);
-    Vec QTQ, VQTQ;
+    Vec &V = ws.vec(Df1k), &R = ws.vec(Df1k), &Hv = ws.vec(Df1k), &M = ws.vec(0), &Z = ws.vec(0);
+    Vec &QTQ = ws.vec(0), &VQTQ = ws.vec(0);
+    KernelTimer timer(tel, "cg", nr_bytes(Q1));
+    const bool side = (f1 < fu) == (f2 < fu);
 
-    if (!(f1 < fu && f2 < fu) && !(f1>=fu && f2>=fu)) {
+    if (!side) {
         QTQ.resize(k*k, 0);
         VQTQ.resize(Df1k, 0);
-        mm(Q1.data(), Q1.data(), QTQ.data(), k, n1);
+        if (param->fold_in) {
+            const vector<ImpDouble> &g = sums[(f1 < fu)? 1: 0].gram[(fu*fv+1)*cross_index(
+                    index_vec(min(f1, f2), max(f1, f2), f))];
+            copy(g.begin(), g.end(), QTQ.begin());
+        }
+        else
+            mm(Q1.data(), Q1.data(), QTQ.data(), k, n1);
+        if (f1 >= fu)
+            sum_all(QTQ.data(), k*k);
     }
 
-    for (ImpLong jd = 0; jd < Df1k; jd++) {
+    auto hess = [&] (const Vec &V, Vec &Hv) {
+        fill(Hv.begin()+o, Hv.end(), 0);
+
+        add_reg(f1, V, Hv);
+
+        if (side)
+            hs_side(rows, n1_all, V, Hv, Q1, X, XT, (f1 < fu)? nnz_u: nnz_v, C);
+        else {
+            mm(V.data()+o, QTQ.data(), VQTQ.data()+o, Df1-o/k, k, k);
+            hs_cross(rows, V, VQTQ, Hv, Q1, X, XT, Y, f1 >= fu, C);
+        }
+        if (f1 < fu)
+            sum_all(Hv.data()+o, len);
+    };
+
+    for (ImpLong jd = o; jd < Df1k; jd++) {
         R[jd] = -G[jd];
-        V[jd] = R[jd];
         g2 += G[jd]*G[jd];
     }
-
     r2 = g2;
-    while (g2*cg_eps < r2 && nr_cg < max_cg) {
-        nr_cg++;
-
-        fill(Hv.begin(), Hv.end(), 0);
-        fill(Hv_.begin(), Hv_.end(), 0);
 
-        if(param->freq){
-            vector<ImpLong> &freq = U1->freq[fi];
-            assert( Df1 == freq.size());
-            for(ImpLong i = 0; i < Df1; i++)
-                axpy( V.data()+i*k, Hv.data()+i*k, k, lambda * ImpDouble(freq[i]));
-        }
-        else{
-            axpy( V.data(), Hv.data(), V.size(), lambda);
+    // The last step, scaled to minimize the quadratic model along it.
+    Vec *S0 = nullptr;
+    if (param->cg_warm) {
+        const ImpInt f12 = (second)? index_vec(f2, f1, f): index_vec(f1, f2, f);
+        S0 = &S_last[2*f12+second];
+        if (S0->size() == size_t(Df1k)) {
+            hess(*S0, Hv);
+            const ImpDouble sHs = inner(S0->data()+o, Hv.data()+o, len);
+            const ImpDouble scale = -inner(G.data()+o, S0->data()+o, len)/sHs;
+            if (sHs > 0 && scale > 0) {
+                axpy(S0->data()+o, S1.data()+o, len, scale);
+                axpy(Hv.data()+o, R.data()+o, len, -scale);
+                r2 = inner(R.data()+o, R.data()+o, len);
+            }
         }
+    }
 
-        if ((f1 < fu && f2 < fu) || (f1>=fu && f2>=fu))
-            hs_side(m1, n1, V, Hv, Q1, X, Y, Hv_);
-        else {
-            mm(V.data(), QTQ.data(), VQTQ.data(), Df1, k, k);
-            hs_cross(m1, n1, V, VQTQ, Hv, Q1, X, Y, Hv_);
-        }
+    if (param->cg_precond) {
+        precond(f1, f2, Q1, QTQ, M);
+        Z.resize(Df1k);
+        for (ImpLong jd = o; jd < Df1k; jd++)
+            Z[jd] = M[jd]*R[jd];
+        rz = inner(R.data()+o, Z.data()+o, len);
+    }
+    else
+        rz = r2;
+    const Vec &Zr = (param->cg_precond)? Z: R;
+    copy(Zr.begin()+o, Zr.end(), V.begin()+o);
+
+    while (g2*cg_eps < r2 && nr_cg < max_cg) {
+        nr_cg++;
 
-        vHv = inner(V.data(), Hv.data(), Df1k);
-        gamma = r2;
+        hess(V, Hv);
+
+        vHv = inner(V.data()+o, Hv.data()+o, len);
+        gamma = rz;
         alpha = gamma/vHv;
-        axpy(V.data(), S1.data(), Df1k, alpha);
-        axpy(Hv.data(), R.data(), Df1k, -alpha);
-        r2 = inner(R.data(), R.data(), Df1k);
-        beta = r2/gamma;
-        scal(V.data(), Df1k, beta);
-        axpy(R.data(), V.data(), Df1k, 1);
+        axpy(V.data()+o, S1.data()+o, len, alpha);
+        axpy(Hv.data()+o, R.data()+o, len, -alpha);
+        r2 = inner(R.data()+o, R.data()+o, len);
+        if (param->cg_precond) {
+            for (ImpLong jd = o; jd < Df1k; jd++)
+                Z[jd] = M[jd]*R[jd];
+            rz = inner(R.data()+o, Z.data()+o, len);
+        }
+        else
+            rz = r2;
+        beta = rz/gamma;
+        scal(V.data()+o, len, beta);
+        axpy(Zr.data()+o, V.data()+o, len, 1);
+    }
+    if (S0 != nullptr)
+        *S0 = S1;
+    if (tel != nullptr) {
+        // V, R, Hv and S are each read and written about once per iteration.
+        timer.add_bytes(8*nr_cg*len*sizeof(ImpFloat));
+        tel->add_cg(nr_cg, g2*cg_eps < r2, (g2 > 0)? sqrt(r2/g2): 0);
     }
 }
 
 void ImpProblem::solve_side(const ImpInt &f1, const ImpInt &f2) {
+    BlockScope block(f1, f2);
     const ImpInt f12 = index_vec(f1, f2, f);
-    const bool sub_type = (f1 < fu)? 1 : 0;
-    const shared_ptr<ImpData> X12 = (sub_type)? U : V;
-    const ImpInt base = (sub_type)? 0 : fu;
-    const vector<Node*> &U1 = X12->Xs[f1-base], &U2 = X12->Xs[f2-base];
     Vec &W1 = W[f12], &H1 = H[f12], &P1 = P[f12], &Q1 = Q[f12];
 
-    Vec G1(W1.size(), 0), G2(H1.size(), 0);
-    Vec S1(W1.size(), 0), S2(H1.size(), 0);
+    Workspace ws;
+    Vec &G1 = ws.vec(W1.size()), &G2 = ws.vec(H1.size());
+    Vec &S1 = ws.vec(W1.size()), &S2 = ws.vec(H1.size());
 
-    gd_side(f1, W1, Q1, G1);
-    cg(f1, f2, S1, Q1, G1, P1);
-    update_side(sub_type, S1, Q1, W1, U1, P1);
+    if (frozen.empty() || !frozen[f1]) {
+        gd_side(f1, W1, Q1, G1);
+        cg(f1, f2, false, S1, Q1, G1, P1);
+        update_side(f1, S1, Q1, W1, P1);
+    }
 
-    gd_side(f2, H1, P1, G2);
-    cg(f2, f1, S2, P1, G2, Q1);
-    update_side(sub_type, S2, P1, H1, U2, Q1);
+    if (frozen.empty() || !frozen[f2]) {
+        gd_side(f2, H1, P1, G2);
+        cg(f2, f1, true, S2, P1, G2, Q1);
+        update_side(f2, S2, P1, H1, Q1);
+    }
 }
 
 void ImpProblem::solve_cross(const ImpInt &f1, const ImpInt &f2) {
+    BlockScope block(f1, f2);
     const ImpInt f12 = index_vec(f1, f2, f);
-    const vector<Node*> &U1 = U->Xs[f1], &V1 = V->Xs[f2-fu];
     Vec &W1 = W[f12], &H1 = H[f12], &P1 = P[f12], &Q1 = Q[f12];
 
-    Vec GW(W1.size()), GH(H1.size());
-    Vec SW(W1.size()), SH(H1.size());
+    Workspace ws;
+    Vec &GW = ws.vec(W1.size()), &GH = ws.vec(H1.size());
+    Vec &SW = ws.vec(W1.size()), &SH = ws.vec(H1.size());
 
-    gd_cross(f1, f12, Q1, W1, GW);
-    cg(f1, f2, SW, Q1, GW, P1);
-    update_cross(true, SW, Q1, W1, U1, P1);
+    if (frozen.empty() || !frozen[f1]) {
+        gd_cross(f1, f12, Q1, W1, GW);
+        cg(f1, f2, false, SW, Q1, GW, P1);
+        update_cross(f1, f12, SW, Q1, W1, P1);
+    }
 
-    gd_cross(f2, f12, P1, H1, GH);
-    cg(f2, f1, SH, P1, GH, Q1);
-    update_cross(false, SH, P1, H1, V1, Q1);
+    if (frozen.empty() || !frozen[f2]) {
+        gd_cross(f2, f12, P1, H1, GH);
+        cg(f2, f1, true, SH, P1, GH, Q1);
+        update_cross(f2, f12, SH, P1, H1, Q1);
+    }
 }
 
 void ImpProblem::one_epoch() {
@@ -869,11 +2492,251 @@ void ImpProblem::one_epoch() {
         cache_sasb();
 }
 
-void ImpProblem::init_va(ImpInt size) {
+// Jacobi schedule: every block takes its W step (then its H step) from the
+// same state, as concurrent tasks, and the steps are merged with one exact
+// line search. The loss is quadratic along the combined direction because
+// y_hat is linear in all W (or all H) blocks together.
+void ImpProblem::one_epoch_jacobi() {
+    vector<pair<ImpInt, ImpInt>> blocks;
+    if (param->self_side) {
+        for (ImpInt f1 = 0; f1 < f; f1++)
+            for (ImpInt f2 = f1; f2 < ((f1 < fu)? fu: f); f2++)
+                blocks.emplace_back(f1, f2);
+    }
+    for (ImpInt f1 = 0; f1 < fu; f1++)
+        for (ImpInt f2 = fu; f2 < f; f2++)
+            blocks.emplace_back(f1, f2);
+
+    const ImpInt nr_blocks = blocks.size();
+    vector<Vec> &G = jacobi_G, &S = jacobi_S, &D = jacobi_D;
+    G.resize(nr_blocks);
+    S.resize(nr_blocks);
+    D.resize(nr_blocks);
+
+    for (ImpInt half = 0; half < 2; half++) {
+        const bool second = (half == 1);
+
+        // Steps reduce across ranks, so under MPI they run in the same order
+        // on every rank.
+        if (mpi_size() > 1) {
+            for (ImpInt bi = 0; bi < nr_blocks; bi++)
+                block_step(blocks[bi].first, blocks[bi].second, second, G[bi], S[bi]);
+        }
+        else {
+#pragma omp parallel
+#pragma omp single
+            for (ImpInt bi = 0; bi < nr_blocks; bi++) {
+#pragma omp task
+                block_step(blocks[bi].first, blocks[bi].second, second, G[bi], S[bi]);
+            }
+        }
+
+        Workspace ws;
+        Vec &da = ws.vec(m, 0, true), &db = ws.vec(n);
+        vector<const ImpFloat*> L, R;
+        ImpDouble gd = 0, reg = 0;
+        for (ImpInt bi = 0; bi < nr_blocks; bi++) {
+            const ImpInt f1 = blocks[bi].first, f2 = blocks[bi].second;
+            const ImpInt f12 = index_vec(f1, f2, f), ff = (second)? f2: f1;
+            const shared_ptr<ImpData> d1 = (ff < fu)? U: V;
+            const ImpInt base = (ff < fu)? 0: fu;
+
+            gd += inner(G[bi].data(), S[bi].data(), S[bi].size());
+            reg += reg_norm(ff, S[bi]);
+
+            {
+                DiskScope disk(d1 == U);
+                D[bi].resize(d1->m*k);
+            }
+            const RowSet rows = rows_of(ff);
+            if (rows.ids == nullptr)
+                UTX(d1->Xs[ff-base], d1->m, S[bi].data(), D[bi]);
+            else {
+                Workspace ws_b;
+                Vec &XS = ws_b.vec(rows.size*k);
+                UTX(d1->Xs[ff-base], rows.size, S[bi].data(), XS);
+                fill(D[bi].begin(), D[bi].end(), 0);
+                for (ImpLong t = 0; t < rows.size; t++)
+                    copy(XS.data()+t*k, XS.data()+(t+1)*k, D[bi].data()+rows[t]*k);
+            }
+            const Vec &O1 = (second)? P[f12]: Q[f12];
+            if (f2 < fu)
+                row_wise_inner(D[bi], O1, m, k, 1, da);
+            else if (f1 >= fu)
+                row_wise_inner(D[bi], O1, n, k, 1, db);
+            else {
+                L.push_back((second)? P[f12].data(): D[bi].data());
+                R.push_back((second)? D[bi].data(): Q[f12].data());
+            }
+        }
+
+        ImpDouble all_sq, pos_sq, pos_sum;
+        sum_sq(da, db, L, R, all_sq, pos_sq, pos_sum);
+        const ImpDouble dHd = w*all_sq + (1-w)*pos_sq + lambda*reg;
+        const ImpDouble step = (gd < 0 && dHd > 0)? -gd/dHd: 0;
+
+        for (ImpInt bi = 0; bi < nr_blocks; bi++) {
+            const ImpInt f1 = blocks[bi].first, f2 = blocks[bi].second;
+            const ImpInt f12 = index_vec(f1, f2, f), ff = (second)? f2: f1;
+            BlockScope block(f1, f2);
+            scal(S[bi].data(), S[bi].size(), step);
+            if ((f1 < fu) == (f2 < fu)) {
+                if (second)
+                    update_side(ff, S[bi], P[f12], H[f12], Q[f12]);
+                else
+                    update_side(ff, S[bi], Q[f12], W[f12], P[f12]);
+            }
+            else {
+                if (second)
+                    update_cross(ff, f12, S[bi], P[f12], H[f12], Q[f12]);
+                else
+                    update_cross(ff, f12, S[bi], Q[f12], W[f12], P[f12]);
+            }
+        }
+
+        if (param->self_side)
+            cache_sasb();
+    }
+}
+
+// Newton direction S and gradient G of one block: its W side, or its H side
+// when second is set.
+void ImpProblem::block_step(const ImpInt &f1, const ImpInt &f2, const bool second,
+        Vec &G, Vec &S) {
+    BlockScope block(f1, f2);
+    const ImpInt f12 = index_vec(f1, f2, f);
+    const ImpInt fa = (second)? f2: f1, fb = (second)? f1: f2;
+    const Vec &W1 = (second)? H[f12]: W[f12];
+    const Vec &Q1 = (second)? P[f12]: Q[f12];
+    Vec &P1 = (second)? Q[f12]: P[f12];
+
+    G.assign(W1.size(), 0);
+    S.assign(W1.size(), 0);
+    if ((f1 < fu) == (f2 < fu))
+        gd_side(fa, W1, Q1, G);
+    else
+        gd_cross(fa, f12, Q1, W1, G);
+    cg(fa, fb, second, S, Q1, G, P1);
+}
+
+ImpDouble ImpProblem::reg_norm(const ImpInt &f1, const Vec &S) {
+    if (!param->freq)
+        return inner(S.data(), S.data(), S.size());
+    const vector<ImpLong> &freq = (f1 < fu)? U->freq[f1]: V->freq[f1-fu];
+    ImpDouble res = 0;
+    for (ImpLong i = 0; i < ImpLong(freq.size()); i++)
+        res += freq[i]*inner(S.data()+i*k, S.data()+i*k, k);
+    return res;
+}
+
+// Sums of v_ij^2 over all m*n pairs, and of v_ij^2 and v_ij over the
+// positives, where v_ij = al[i] + be[j] + sum_b L_b[i].R_b[j]. The full sum
+// is expanded into k-by-k Gram matrices; the user-side terms are summed over
+// ranks.
+void ImpProblem::sum_sq(const Vec &al, const Vec &be, const vector<const ImpFloat*> &L,
+        const vector<const ImpFloat*> &R, ImpDouble &all_sq, ImpDouble &pos_sq, ImpDouble &pos_sum) {
+    const ImpInt nr_blocks = L.size();
+    KernelTimer timer(tel, "sum_sq", 2*nr_blocks*(m+n)*k*sizeof(ImpFloat));
+    Workspace ws;
+    const Vec &o1 = ws.vec(m, 1, true), &o2 = ws.vec(n, 1);
+    Vec &La = ws.vec(k), &Lo = ws.vec(k), &Rb = ws.vec(k), &Ro = ws.vec(k), &GL = ws.vec(k*k), &GR = ws.vec(k*k);
+
+    ImpDouble al_sums[2] = {inner(al.data(), al.data(), m), sum(al)};
+    sum_all(al_sums, 2);
+    all_sq = ImpDouble(n)*al_sums[0] + ImpDouble(m_all)*inner(be.data(), be.data(), n)
+        + 2*al_sums[1]*sum(be);
+    for (ImpInt b1 = 0; b1 < nr_blocks; b1++) {
+        mv(L[b1], al.data(), La.data(), m, k, 0, true);
+        mv(L[b1], o1.data(), Lo.data(), m, k, 0, true);
+        sum_all(La.data(), k);
+        sum_all(Lo.data(), k);
+        mv(R[b1], be.data(), Rb.data(), n, k, 0, true);
+        mv(R[b1], o2.data(), Ro.data(), n, k, 0, true);
+        all_sq += 2*inner(La.data(), Ro.data(), k) + 2*inner(Lo.data(), Rb.data(), k);
+        for (ImpInt b2 = b1; b2 < nr_blocks; b2++) {
+            mm(L[b1], L[b2], GL.data(), k, m);
+            sum_all(GL.data(), k*k);
+            mm(R[b1], R[b2], GR.data(), k, n);
+            all_sq += ((b1 == b2)? 1: 2)*inner(GL.data(), GR.data(), k*k);
+        }
+    }
+
+    const CSR &Y = U->Y;
+    ImpDouble sq = 0, sm = 0;
+#pragma omp parallel for schedule(guided) reduction(+: sq, sm)
+    for (ImpLong i = 0; i < m; i++) {
+        for (ImpLong s = Y.ptr[i]; s < Y.ptr[i+1]; s++) {
+            const ImpLong j = Y.idx[s];
+            ImpDouble v = al[i]+be[j];
+            for (ImpInt b1 = 0; b1 < nr_blocks; b1++)
+                v += inner(L[b1]+i*k, R[b1]+j*k, k);
+            sq += v*v;
+            sm += v;
+        }
+    }
+    ImpDouble pos_sums[2] = {sq, sm};
+    sum_all(pos_sums, 2);
+    pos_sq = pos_sums[0];
+    pos_sum = pos_sums[1];
+}
+
+// Same value as func(), with lambda weighted by frequency under --freq, in
+// O((m+n)k^2) per pair of cross blocks instead of O(mn).
+ImpDouble ImpProblem::objective() {
+    KernelTimer timer(tel, "objective");
+    Workspace ws;
+    Vec &al = ws.vec(m, 0, true);
+    for (ImpLong i = 0; i < m; i++)
+        al[i] = a[i]-r;
+
+    vector<const ImpFloat*> L, R;
+    for (ImpInt f1 = 0; f1 < fu; f1++) {
+        for (ImpInt f2 = fu; f2 < f; f2++) {
+            const ImpInt f12 = index_vec(f1, f2, f);
+            L.push_back(P[f12].data());
+            R.push_back(Q[f12].data());
+        }
+    }
+
+    ImpDouble all_sq, pos_sq, pos_sum;
+    sum_sq(al, b, L, R, all_sq, pos_sq, pos_sum);
+    ImpLong nnz_y = U->Y.nnz();
+    sum_all(&nnz_y, 1);
+    ImpDouble res = w*all_sq + (1-w)*pos_sq + 2*(r-1)*pos_sum + (r-1)*(r-1)*nnz_y;
+
+    for (ImpInt f1 = 0; f1 < f; f1++) {
+        for (ImpInt f2 = f1; f2 < f; f2++) {
+            const ImpInt f12 = index_vec(f1, f2, f);
+            // Self-side blocks are not allocated without self_side.
+            if (W[f12].empty())
+                continue;
+            res += lambda*(reg_norm(f1, W[f12]) + reg_norm(f2, H[f12]));
+        }
+    }
+    return 0.5*res;
+}
+
+void ImpProblem::init_va() {
 
     if (Uva->file_name.empty())
         return;
 
+    // A fixed sample of the validation users, drawn once; under MPI each
+    // rank draws its share.
+    if (param->va_sample > 0) {
+        ImpLong mva = Uva->m;
+        sum_all(&mva, 1);
+        const ImpLong nr_sample = min<ImpLong>(Uva->m, llround(ImpDouble(param->va_sample)*Uva->m/mva));
+        if (nr_sample < Uva->m) {
+            vector<ImpLong> rows(Uva->m);
+            iota(rows.begin(), rows.end(), 0);
+            shuffle(rows.begin(), rows.end(), default_random_engine(1+mpi_rank()));
+            rows.resize(nr_sample);
+            sort(rows.begin(), rows.end());
+            Uva = Uva->select_rows(rows);
+        }
+    }
+
     mt = Uva->m;
 
     const ImpInt nr_blocks = f*(f+1)/2;
@@ -881,83 +2744,101 @@ void ImpProblem::init_va(ImpInt size) {
     Pva.resize(nr_blocks);
     Qva.resize(nr_blocks);
 
-    for (ImpInt f1 = 0; f1 < f; f1++) {
-        const shared_ptr<ImpData> d1 = ((f1<fu)? Uva: V);
+    for (ImpInt f1 = 0; f1 < fu; f1++) {
         for (ImpInt f2 = f1; f2 < f; f2++) {
-            const shared_ptr<ImpData> d2 = ((f2<fu)? Uva: V);
             const ImpInt f12 = index_vec(f1, f2, f);
-            if(!param->self_side && (f1>=fu || f2<fu))
+            if(!param->self_side && f2<fu)
                 continue;
-            Pva[f12].resize(d1->m*k);
-            Qva[f12].resize(d2->m*k);
+            Pva[f12].resize(mt*k);
+            if (f2 < fu)
+                Qva[f12].resize(mt*k);
         }
     }
 
+    top_k = param->top_k;
+    const ImpInt size = top_k.size();
     va_loss_prec.resize(size);
     va_loss_ndcg.resize(size);
-    top_k.resize(size);
-    ImpInt start = 5;
+
+    // Early stopping on p@K or nDCG@K, with K in the list, or on ploss.
+    const string &metric = param->early_stop;
+    const size_t at = metric.find('@');
+    if (metric == "ploss") {
+        stop_kind = 'l';
+    }
+    else if (at != string::npos && (metric.substr(0, at) == "p" || metric.substr(0, at) == "ndcg")) {
+        const auto it = find(top_k.begin(), top_k.end(), atoi(metric.c_str()+at+1));
+        if (it == top_k.end())
+            throw invalid_argument("early stopping on " + metric + " needs its K in the K list");
+        stop_kind = metric[0];
+        stop_idx = it-top_k.begin();
+    }
+    else if (!metric.empty()) {
+        throw invalid_argument("unknown early stopping metric " + metric);
+    }
 
     cout << "iter";
     for (ImpInt i = 0; i < size; i++) {
-        top_k[i] = start;
         cout.width(9);
-        cout << "( p@ " << start << ", ";
+        cout << "( p@ " << top_k[i] << ", ";
         cout.width(6);
-        cout << "nDCG@" << start << " )";
-        start *= 2;
+        cout << "nDCG@" << top_k[i] << " )";
     }
     cout.width(12);
     cout << "ploss";
     cout << endl;
 }
 
-void ImpProblem::pred_z(const ImpLong i, ImpDouble *z) {
-    for(ImpInt f1 = 0; f1 < fu; f1++) {
-        for(ImpInt f2 = fu; f2 < f; f2++) {
-            ImpInt f12 = index_vec(f1, f2, f);
-            ImpDouble *p1 = Pva[f12].data()+i*k, *q1 = Qva[f12].data();
-            mv(q1, p1, z, n, k, 1, false);
-        }
+// Keeps W and H of the best evaluation so far. True once patience
+// evaluations in a row have not improved on it.
+bool ImpProblem::early_stop(const ImpInt iter) {
+    const ImpDouble score = (stop_kind == 'l')? -loss:
+        (stop_kind == 'p')? va_loss_prec[stop_idx]: va_loss_ndcg[stop_idx];
+    if (best_epoch == 0 || score > best_score) {
+        best_score = score;
+        best_epoch = iter+1;
+        bad_evals = 0;
+        W_best = W;
+        H_best = H;
+        return false;
     }
+    return ++bad_evals >= param->patience;
 }
 
 void ImpProblem::validate() {
+    KernelTimer timer(tel, "validate");
     const ImpInt nr_th = param->nr_threads, nr_k = top_k.size();
     ImpLong valid_samples = 0;
 
     vector<ImpLong> hit_counts(nr_th*nr_k, 0);
     vector<ImpDouble> ndcg_scores(nr_th*nr_k, 0);
 
-    for (ImpInt f1 = 0; f1 < f; f1++) {
-        const shared_ptr<ImpData> d1 = ((f1<fu)? Uva: V);
-        const ImpInt fi = ((f1>=fu)? f1-fu: f1);
-
+    // Items are the training items, so their projections are P and Q.
+    for (ImpInt f1 = 0; f1 < fu; f1++) {
         for (ImpInt f2 = f1; f2 < f; f2++) {
-            const shared_ptr<ImpData> d2 = ((f2<fu)? Uva: V);
-            const ImpInt fj = ((f2>=fu)? f2-fu: f2);
-
             const ImpInt f12 = index_vec(f1, f2, f);
-            if(!param->self_side && (f1>=fu || f2<fu))
+            if(!param->self_side && f2<fu)
                 continue;
-            UTX(d1->Xs[fi], d1->m, W[f12], Pva[f12]);
-            UTX(d2->Xs[fj], d2->m, H[f12], Qva[f12]);
+            UTX(Uva->Xs[f1], mt, W[f12].data(), Pva[f12]);
+            if (f2 < fu)
+                UTX(Uva->Xs[f2], mt, H[f12].data(), Qva[f12]);
         }
     }
 
-    Vec at(Uva->m, 0), bt(V->m, 0);
+    Vec at(mt, 0);
+    bt.assign(n, 0);
 
     if (param->self_side) {
         for (ImpInt f1 = 0; f1 < fu; f1++) {
             for (ImpInt f2 = f1; f2 < fu; f2++) {
                 const ImpInt f12 = index_vec(f1, f2, f);
-                add_side(Pva[f12], Qva[f12], Uva->m, at);
+                add_side(Pva[f12], Qva[f12], mt, at);
             }
         }
         for (ImpInt f1 = fu; f1 < f; f1++) {
             for (ImpInt f2 = f1; f2 < f; f2++) {
                 const ImpInt f12 = index_vec(f1, f2, f);
-                add_side(Pva[f12], Qva[f12], V->m, bt);
+                add_side(P[f12], Q[f12], n, bt);
             }
         }
     }
@@ -969,37 +2850,62 @@ void ImpProblem::validate() {
     }
     cout << endl;
 #endif
-#pragma omp parallel for schedule(static) reduction(+: valid_samples, ploss)
-    for (ImpLong i = 0; i < Uva->m; i++) {
-        Vec z, z_copy;
-        if(Uva->nnx[i] == 0) {
-            z.assign(U->popular.begin(), U->popular.end());
-        }
-        else {
-            z.assign(bt.begin(), bt.end());
-            pred_z(i, z.data());
-        }
-        for(Node* y = Uva->Y[i]; y < Uva->Y[i+1]; y++){
-            const ImpLong j = y->idx;
-            if (j < z.size())
-                ploss += (1-z[j]-at[i])*(1-z[j]-at[i]);
-        }
+    const ImpInt max_k = *max_element(top_k.begin(), top_k.end());
+    const vector<ImpDouble> &popular = U->popular;
+    const ImpLong max_z_idx = min<ImpLong>(n, popular.size());
+
+    vector<ImpLong> popular_top, items;
+    Vec scores;
+    select_top(popular.data(), popular.size(), max_k, popular_top);
+
+    for (ImpLong i0 = 0; i0 < mt; i0 += VA_BATCH_SIZE) {
+        const ImpLong i1 = min<ImpLong>(mt, i0+VA_BATCH_SIZE);
+        rank_items(Pva, Q, i0, i1, max_z_idx, max_k, items, scores);
+        const ImpLong nr_top = items.size()/(i1-i0);
+
+#pragma omp parallel reduction(+: valid_samples, ploss)
+{
+        vector<ImpLong> top, labels;
+#pragma omp for schedule(static)
+        for (ImpLong i = i0; i < i1; i++) {
+            const bool empty = (Uva->nnx[i] == 0);
+            labels.clear();
+            for(ImpLong s = Uva->Y.ptr[i]; s < Uva->Y.ptr[i+1]; s++){
+                const ImpLong j = Uva->Y.idx[s];
+                labels.push_back(j);
+                if (j < ((empty)? popular.size(): n)) {
+                    const ImpDouble z_j = (empty)? popular[j]: bt[j]+calc_cross(Pva, Q, i, j);
+                    ploss += (1-z_j-at[i])*(1-z_j-at[i]);
+                }
+            }
+            sort(labels.begin(), labels.end());
 
+            if (empty)
+                top = popular_top;
+            else
+                top.assign(items.begin()+(i-i0)*nr_top, items.begin()+(i-i0+1)*nr_top);
 #ifdef EBUG_nDCG
-        z.resize(n);
-        z_copy.resize(n);
-        for(ImpInt i = 0; i < n ; i++)
-          z[i] = z_copy[i] = n - i;
+            top.resize(min<ImpLong>(max_k, n));
+            iota(top.begin(), top.end(), 0);
 #endif
-        z_copy.assign(z.begin(), z.end());
-        // Precision @
-        prec_k(z.data(), i, hit_counts);
-        // nDCG
-        ndcg(z_copy.data(), i, ndcg_scores);
-        valid_samples++;
+            // Precision @
+            prec_k(top, labels, hit_counts);
+            // nDCG
+            ndcg(top, labels, i, ndcg_scores);
+            valid_samples++;
+        }
+}
     }
 
-    loss = sqrt(ploss/Uva->m);
+    // Validation users are split over ranks like the training users.
+    ImpLong mva = Uva->m;
+    sum_all(&mva, 1);
+    sum_all(&valid_samples, 1);
+    sum_all(&ploss, 1);
+    sum_all(hit_counts.data(), hit_counts.size());
+    sum_all(ndcg_scores.data(), ndcg_scores.size());
+
+    loss = sqrt(ploss/mva);
 
     fill(va_loss_prec.begin(), va_loss_prec.end(), 0);
     fill(va_loss_ndcg.begin(), va_loss_ndcg.end(), 0);
@@ -1015,115 +2921,547 @@ void ImpProblem::validate() {
     }
 }
 
-void ImpProblem::prec_k(ImpDouble *z, ImpLong i, vector<ImpLong> &hit_counts) {
-    ImpInt valid_count = 0;
-    const ImpInt nr_k = top_k.size();
-    vector<ImpLong> hit_count(nr_k, 0);
+bool higher(const pair<ImpDouble, ImpLong> &lhs, const pair<ImpDouble, ImpLong> &rhs) {
+    return lhs.first > rhs.first || (lhs.first == rhs.first && lhs.second < rhs.second);
+}
 
-    ImpInt num_th = omp_get_thread_num();
+// Keeps the best top_n (score, item) pairs; the heap front is the weakest.
+inline void push_top(vector<pair<ImpDouble, ImpLong>> &heap, const ImpLong top_n,
+        const ImpDouble score, const ImpLong j) {
+    if (ImpLong(heap.size()) < top_n) {
+        heap.emplace_back(score, j);
+        push_heap(heap.begin(), heap.end(), higher);
+    }
+    else if (score > heap.front().first) {
+        pop_heap(heap.begin(), heap.end(), higher);
+        heap.back() = make_pair(score, j);
+        push_heap(heap.begin(), heap.end(), higher);
+    }
+}
 
-#ifdef EBUG
-    //cout << i << ":";
-#endif
-    ImpLong max_z_idx = U->popular.size();
-    for (ImpInt state = 0; state < nr_k; state++) {
-        while(valid_count < top_k[state]) {
-            if ( valid_count >= max_z_idx )
-               break;
-            ImpLong argmax = distance(z, max_element(z, z + max_z_idx));
-#ifdef EBUG
-    //        cout << argmax << " ";
-#endif
-            z[argmax] = MIN_Z;
-            for (Node* nd = Uva->Y[i]; nd < Uva->Y[i+1]; nd++) {
-                if (argmax == nd->idx) {
-                    hit_count[state]++;
-                    break;
-                }
+ItemIndex::ItemIndex(const Vec &E, const ImpLong n, const ImpLong dim, const ImpInt nr_lists)
+    : dim(dim) {
+    const ImpLong L = max<ImpLong>(1, min<ImpLong>(nr_lists, n)), dl = dim+1;
+    Vec lifted(n*dl);
+    ImpDouble max_sq = 0;
+    for (ImpLong j = 0; j < n; j++)
+        max_sq = max(max_sq, dot(E.data()+j*dim, E.data()+j*dim, dim));
+    for (ImpLong j = 0; j < n; j++) {
+        const ImpFloat *e = E.data()+j*dim;
+        copy(e, e+dim, lifted.begin()+j*dl);
+        lifted[j*dl+dim] = sqrt(max(0.0, max_sq-dot(e, e, dim)));
+    }
+
+    // Lloyd iterations on a sample of up to 64 items per list.
+    default_random_engine engine(1);
+    vector<ImpLong> sample(n);
+    iota(sample.begin(), sample.end(), 0);
+    shuffle(sample.begin(), sample.end(), engine);
+    sample.resize(min<ImpLong>(n, 64*L));
+    const ImpLong ns = sample.size();
+
+    Vec C(L*dl);
+    for (ImpLong l = 0; l < L; l++)
+        copy(lifted.begin()+sample[l]*dl, lifted.begin()+(sample[l]+1)*dl, C.begin()+l*dl);
+    vector<ImpDouble> C_sq(L);
+    auto nearest = [&] (const ImpFloat *x) {
+        ImpLong best = 0;
+        ImpDouble best_d = numeric_limits<ImpDouble>::max();
+        for (ImpLong l = 0; l < L; l++) {
+            const ImpDouble d = C_sq[l]-2*dot(x, C.data()+l*dl, dl);
+            if (d < best_d) {
+                best_d = d;
+                best = l;
+            }
+        }
+        return best;
+    };
+    auto update_sq = [&] {
+        for (ImpLong l = 0; l < L; l++)
+            C_sq[l] = dot(C.data()+l*dl, C.data()+l*dl, dl);
+    };
+
+    vector<ImpLong> label(n);
+    vector<ImpLong> counts(L);
+    for (ImpInt iter = 0; iter < 10; iter++) {
+        update_sq();
+#pragma omp parallel for schedule(static)
+        for (ImpLong s = 0; s < ns; s++)
+            label[s] = nearest(lifted.data()+sample[s]*dl);
+        fill(C.begin(), C.end(), 0);
+        fill(counts.begin(), counts.end(), 0);
+        for (ImpLong s = 0; s < ns; s++) {
+            axpy_k(lifted.data()+sample[s]*dl, C.data()+label[s]*dl, dl, 1);
+            counts[label[s]]++;
+        }
+        for (ImpLong l = 0; l < L; l++) {
+            if (counts[l] == 0) {
+                const ImpLong j = sample[engine()%ns];
+                copy(lifted.begin()+j*dl, lifted.begin()+(j+1)*dl, C.begin()+l*dl);
             }
-            valid_count++;
+            else
+                scal(C.data()+l*dl, dl, 1.0/counts[l]);
         }
     }
 
-#ifdef EBUG
-    //cout << endl;
-#endif
-    for (ImpInt i = 1; i < nr_k; i++) {
-        hit_count[i] += hit_count[i-1];
+    update_sq();
+#pragma omp parallel for schedule(static)
+    for (ImpLong j = 0; j < n; j++)
+        label[j] = nearest(lifted.data()+j*dl);
+
+    lists.assign(L+1, 0);
+    for (ImpLong j = 0; j < n; j++)
+        lists[label[j]+1]++;
+    partial_sum(lists.begin(), lists.end(), lists.begin());
+    vector<ImpLong> pos(lists.begin(), lists.end()-1);
+    ids.resize(n);
+    items.resize(n*dim);
+    for (ImpLong j = 0; j < n; j++) {
+        const ImpLong s = pos[label[j]]++;
+        ids[s] = j;
+        copy(E.begin()+j*dim, E.begin()+(j+1)*dim, items.begin()+s*dim);
     }
-    for (ImpInt i = 0; i < nr_k; i++) {
-        hit_counts[i+num_th*nr_k] += hit_count[i];
+    centroids.resize(L*dim);
+    c_sq = C_sq;
+    for (ImpLong l = 0; l < L; l++)
+        copy(C.begin()+l*dl, C.begin()+l*dl+dim, centroids.begin()+l*dim);
+}
+
+// The query is lifted by 0, so its distance to a centroid c ranks as
+// |c|^2-2q.c over the first dim coordinates.
+void ItemIndex::search(const ImpFloat *q, const ImpInt top_n, const ImpInt nr_probe,
+        vector<pair<ImpDouble, ImpLong>> &order, vector<pair<ImpDouble, ImpLong>> &heap) const {
+    const ImpLong L = nr_lists(), nr_p = min<ImpLong>(max<ImpInt>(nr_probe, 1), L);
+    order.resize(L);
+    for (ImpLong l = 0; l < L; l++)
+        order[l] = make_pair(2*dot(q, centroids.data()+l*dim, dim)-c_sq[l], l);
+    partial_sort(order.begin(), order.begin()+nr_p, order.end(), higher);
+
+    // Lists past nr_probe are taken, nearest first, until top_n items are.
+    heap.clear();
+    for (ImpLong p = 0; p < L && (p < nr_p || ImpLong(heap.size()) < top_n); p++) {
+        if (p == nr_p)
+            sort(order.begin()+nr_p, order.end(), higher);
+        const ImpLong l = order[p].second;
+        for (ImpLong s = lists[l]; s < lists[l+1]; s++)
+            push_top(heap, top_n, dot(q, items.data()+s*dim, dim), ids[s]);
     }
+    sort_heap(heap.begin(), heap.end(), higher);
 }
 
-void ImpProblem::ndcg(ImpDouble *z, ImpLong i, vector<ImpDouble> &ndcg_scores) {
-    ImpInt valid_count = 0;
-    const ImpInt nr_k = top_k.size();
-    vector<ImpDouble> dcg_score(nr_k, 0);
-    vector<ImpDouble> idcg_score(nr_k, 0);
+// Ranks items [0, n1) for users [i0, i1). A tile of users is scored against
+// a tile of items with one GEMM per cross field pair, and the tile is pushed
+// into the users' heaps while it is still in cache, so no full score row is
+// ever stored. Scores exclude the user self-side term.
+void ImpProblem::rank_items(const vector<Vec> &Pu, const vector<Vec> &Qi,
+        const ImpLong i0, const ImpLong i1, const ImpLong n1, const ImpInt top_n,
+        vector<ImpLong> &items, Vec &scores) {
+    const ImpLong mu = i1-i0, nr_top = min<ImpLong>(top_n, n1);
+    const ImpLong nr_tiles = (mu+SCORE_USER_TILE-1)/SCORE_USER_TILE;
+    items.resize(mu*nr_top);
+    scores.resize(mu*nr_top);
+    if (nr_top == 0)
+        return;
 
-    ImpInt num_th = omp_get_thread_num();
+    vector<ImpInt> cross;
+    for (ImpInt f1 = 0; f1 < fu; f1++)
+        for (ImpInt f2 = fu; f2 < f; f2++)
+            if (!Pu[index_vec(f1, f2, f)].empty())
+                cross.push_back(index_vec(f1, f2, f));
 
-#ifdef EBUG_nDCG
-#ifndef SHOW_SCORE_ONLY
-    bool show_label = true;
-    cout << i << ":";
-#endif
-#endif
-    ImpLong max_z_idx = U->popular.size();
-    for (ImpInt state = 0; state < nr_k; state++) {
-        while(valid_count < top_k[state]) {
-            if ( valid_count >= max_z_idx )
-               break;
-            ImpLong argmax = distance(z, max_element(z, z + max_z_idx));
-#ifdef EBUG_nDCG
-#ifndef SHOW_SCORE_ONLY
-            if( 10 < top_k[state] )
-              break;
-            cout << argmax << " ";
-#endif
-#endif
-            z[argmax] = MIN_Z;
-#ifdef EBUG_nDCG
-#ifndef SHOW_SCORE_ONLY
-            if(show_label) {
-              cout << "(";
-              for (Node* nd = Uva->Y[i]; nd < Uva->Y[i+1]; nd++)
-                  cout << nd->idx << ",";
-              cout << ")" << endl;
-              show_label = false;
+#pragma omp parallel
+{
+    Vec Z(SCORE_USER_TILE*SCORE_ITEM_TILE);
+    vector<vector<pair<ImpDouble, ImpLong>>> heaps(SCORE_USER_TILE);
+#pragma omp for schedule(dynamic)
+    for (ImpLong t = 0; t < nr_tiles; t++) {
+        const ImpLong u0 = i0+t*SCORE_USER_TILE, mt1 = min<ImpLong>(SCORE_USER_TILE, i1-u0);
+        for (ImpLong u = 0; u < mt1; u++)
+            heaps[u].clear();
+
+        for (ImpLong j0 = 0; j0 < n1; j0 += SCORE_ITEM_TILE) {
+            const ImpLong nt = min<ImpLong>(SCORE_ITEM_TILE, n1-j0);
+            for (ImpLong u = 0; u < mt1; u++)
+                copy(bt.begin()+j0, bt.begin()+j0+nt, Z.begin()+u*nt);
+            for (ImpInt f12 : cross)
+                mmt(Pu[f12].data()+u0*k, Qi[f12].data()+j0*k, Z.data(), mt1, nt, k, 1);
+            for (ImpLong u = 0; u < mt1; u++) {
+                const ImpFloat *z = Z.data()+u*nt;
+                for (ImpLong j = 0; j < nt; j++)
+                    push_top(heaps[u], nr_top, z[j], j0+j);
             }
-#endif
-#endif
-            for (Node* nd = Uva->Y[i]; nd < Uva->Y[i+1]; nd++) {
-                if (argmax == nd->idx) {
-                    dcg_score[state] += 1.0 / log2(valid_count + 2);
-                    break;
+        }
+
+        for (ImpLong u = 0; u < mt1; u++) {
+            vector<pair<ImpDouble, ImpLong>> &heap = heaps[u];
+            sort_heap(heap.begin(), heap.end(), higher);
+            const ImpLong base = (u0-i0+u)*nr_top;
+            for (ImpLong r = 0; r < nr_top; r++) {
+                items[base+r] = heap[r].second;
+                scores[base+r] = heap[r].first;
+            }
+        }
+    }
+}
+}
+
+// rank_items against quantized item vectors: each score is an item's scale
+// times the float dot product of the user's row of Pf with the item's row.
+template <typename T>
+void rank_quantized(const float *Pf, const ImpLong mu, const ImpLong dim,
+        const T *E, const float *Es, const ImpLong n1, const ImpInt top_n,
+        vector<ImpLong> &items, Vec &scores) {
+    const ImpLong nr_top = min<ImpLong>(top_n, n1);
+    const ImpLong nr_tiles = (mu+SCORE_USER_TILE-1)/SCORE_USER_TILE;
+    items.resize(mu*nr_top);
+    scores.resize(mu*nr_top);
+    if (nr_top == 0)
+        return;
+
+#pragma omp parallel
+{
+    vector<vector<pair<ImpDouble, ImpLong>>> heaps(SCORE_USER_TILE);
+#pragma omp for schedule(dynamic)
+    for (ImpLong t = 0; t < nr_tiles; t++) {
+        const ImpLong u0 = t*SCORE_USER_TILE, mt1 = min<ImpLong>(SCORE_USER_TILE, mu-u0);
+        for (ImpLong u = 0; u < mt1; u++)
+            heaps[u].clear();
+
+        for (ImpLong j0 = 0; j0 < n1; j0 += SCORE_ITEM_TILE) {
+            const ImpLong j1 = min<ImpLong>(n1, j0+SCORE_ITEM_TILE);
+            for (ImpLong u = 0; u < mt1; u++) {
+                const float *p = Pf+(u0+u)*dim;
+                for (ImpLong j = j0; j < j1; j++)
+                    push_top(heaps[u], nr_top, Es[j]*dot_q(p, E+j*dim, dim), j);
+            }
+        }
+
+        for (ImpLong u = 0; u < mt1; u++) {
+            vector<pair<ImpDouble, ImpLong>> &heap = heaps[u];
+            sort_heap(heap.begin(), heap.end(), higher);
+            const ImpLong base = (u0+u)*nr_top;
+            for (ImpLong r = 0; r < nr_top; r++) {
+                items[base+r] = heap[r].second;
+                scores[base+r] = heap[r].first;
+            }
+        }
+    }
+}
+}
+
+// The users' P rows of all cross field pairs, followed by 1, in the layout
+// of the item vectors.
+void ImpProblem::rank_items_q(const vector<Vec> &Pu, const ImpLong mu, const ImpInt top_n,
+        vector<ImpLong> &items, Vec &scores) {
+    vector<float> Pf(mu*e_dim);
+#pragma omp parallel for schedule(static)
+    for (ImpLong i = 0; i < mu; i++) {
+        float *p = Pf.data()+i*e_dim;
+        for (ImpInt f1 = 0, c = 0; f1 < fu; f1++)
+            for (ImpInt f2 = fu; f2 < f; f2++, c++)
+                copy(Pu[index_vec(f1, f2, f)].begin()+i*k,
+                        Pu[index_vec(f1, f2, f)].begin()+(i+1)*k, p+c*k);
+        p[e_dim-1] = 1;
+    }
+    if (qbytes == QUANT_INT8)
+        rank_quantized(Pf.data(), mu, e_dim, E8.data(), Es.data(), n, top_n, items, scores);
+    else
+        rank_quantized(Pf.data(), mu, e_dim, reinterpret_cast<const Half*>(E16.data()),
+                Es.data(), n, top_n, items, scores);
+}
+
+// Single pass over the scores with a size-top_n heap whose front is the
+// weakest kept item; ties go to the smaller index, as with max_element.
+void select_top(const ImpDouble *z, const ImpLong n, const ImpInt top_n, vector<ImpLong> &top) {
+    const ImpLong nr_top = min<ImpLong>(top_n, n);
+    auto higher = [&] (const ImpLong &lhs, const ImpLong &rhs) {
+        return z[lhs] > z[rhs] || (z[lhs] == z[rhs] && lhs < rhs);
+    };
+    top.resize(nr_top);
+    if (nr_top == 0)
+        return;
+    iota(top.begin(), top.end(), 0);
+    make_heap(top.begin(), top.end(), higher);
+    for (ImpLong j = nr_top; j < n; j++) {
+        if (z[j] <= z[top.front()])
+            continue;
+        pop_heap(top.begin(), top.end(), higher);
+        top.back() = j;
+        push_heap(top.begin(), top.end(), higher);
+    }
+    sort_heap(top.begin(), top.end(), higher);
+}
+
+void ImpProblem::init_predict() {
+    const ImpInt nr_blocks = f*(f+1)/2;
+    n = V->m;
+    Qva.resize(nr_blocks);
+    bt.assign(n, 0);
+
+    if (model_map == nullptr) {
+        Wm.assign(nr_blocks, nullptr);
+        Hm.assign(nr_blocks, nullptr);
+        for (ImpInt f12 = 0; f12 < nr_blocks; f12++) {
+            if (!W[f12].empty()) {
+                Wm[f12] = W[f12].data();
+                Hm[f12] = H[f12].data();
+            }
+        }
+    }
+
+    for (ImpInt f1 = 0; f1 < f; f1++) {
+        for (ImpInt f2 = max(f1, fu); f2 < f; f2++) {
+            const ImpInt f12 = index_vec(f1, f2, f);
+            if (!has_block(f12))
+                continue;
+            Qva[f12].resize(n*k);
+            project(V->Xs[f2-fu], n, f12, true, Qva[f12]);
+            if (f1 >= fu) {
+                Vec Pv(n*k);
+                project(V->Xs[f1-fu], n, f12, false, Pv);
+                add_side(Pv, Qva[f12], n, bt);
+            }
+        }
+    }
+    if (qbytes > 0)
+        quantize_items();
+}
+
+bool ImpProblem::has_block(const ImpInt f12) const {
+    return (qbytes > 0)? Wq[f12].q != nullptr: Wm[f12] != nullptr;
+}
+
+// C = X times the W rows, or the H rows, of block f12 of either kind of model.
+void ImpProblem::project(const CSR &X, const ImpLong m1, const ImpInt f12,
+        const bool h_side, Vec &C) {
+    if (qbytes > 0)
+        UTX(X, m1, h_side? Hq[f12]: Wq[f12], C);
+    else
+        UTX(X, m1, h_side? Hm[f12]: Wm[f12], C);
+}
+
+void quantize_row(const ImpFloat *x, const ImpLong len, int8_t *q, float &scale) {
+    ImpDouble amax = 0;
+    for (ImpLong d = 0; d < len; d++)
+        amax = max<ImpDouble>(amax, fabs(x[d]));
+    scale = amax/127;
+    const ImpDouble inv = (amax > 0)? 127/amax: 0;
+    for (ImpLong d = 0; d < len; d++)
+        q[d] = int8_t(lrint(x[d]*inv));
+}
+
+void quantize_row(const ImpFloat *x, const ImpLong len, Half *q, float &scale) {
+    ImpDouble amax = 0;
+    for (ImpLong d = 0; d < len; d++)
+        amax = max<ImpDouble>(amax, fabs(x[d]));
+    scale = amax;
+    const ImpDouble inv = (amax > 0)? 1/amax: 0;
+    for (ImpLong d = 0; d < len; d++)
+        q[d].bits = float_to_half(x[d]*inv);
+}
+
+void ImpProblem::quantize_items() {
+    Vec E;
+    e_dim = item_vectors(E);
+    Es.resize(n);
+    if (qbytes == QUANT_INT8)
+        E8.resize(n*e_dim);
+    else
+        E16.resize(n*e_dim);
+    Half *e16 = reinterpret_cast<Half*>(E16.data());
+#pragma omp parallel for schedule(static)
+    for (ImpLong j = 0; j < n; j++) {
+        if (qbytes == QUANT_INT8)
+            quantize_row(E.data()+j*e_dim, e_dim, E8.data()+j*e_dim, Es[j]);
+        else
+            quantize_row(E.data()+j*e_dim, e_dim, e16+j*e_dim, Es[j]);
+    }
+}
+
+// Row j of E is item j's Q rows of all cross field pairs followed by bt[j],
+// so a user's score of j, less the user self-side term, is the inner
+// product of E_j with the user's P rows followed by 1. Returns the width.
+ImpLong ImpProblem::item_vectors(Vec &E) {
+    vector<ImpInt> cross;
+    for (ImpInt f1 = 0; f1 < fu; f1++)
+        for (ImpInt f2 = fu; f2 < f; f2++)
+            cross.push_back(index_vec(f1, f2, f));
+    const ImpLong dim = cross.size()*k+1;
+    E.resize(n*dim);
+#pragma omp parallel for schedule(static)
+    for (ImpLong j = 0; j < n; j++) {
+        ImpFloat *e = E.data()+j*dim;
+        for (ImpInt c = 0; c < cross.size(); c++)
+            copy(Qva[cross[c]].begin()+j*k, Qva[cross[c]].begin()+(j+1)*k, e+c*k);
+        e[dim-1] = bt[j];
+    }
+    return dim;
+}
+
+void ImpProblem::export_items(const string &path) {
+    ofstream out(path);
+    if (!out.is_open())
+        throw invalid_argument("cannot open " + path);
+    Vec E;
+    const ImpLong dim = item_vectors(E);
+    out << setprecision(8);
+    for (ImpLong j = 0; j < n; j++) {
+        for (ImpLong d = 0; d < dim; d++)
+            out << ((d > 0)? " ": "") << E[j*dim+d];
+        out << '\n';
+    }
+}
+
+void ImpProblem::build_index(const ImpInt nr_lists, const ImpInt nr_probe) {
+    Vec E;
+    const ImpLong dim = item_vectors(E);
+    index = make_shared<ItemIndex>(E, n, dim, nr_lists);
+    this->nr_probe = nr_probe;
+}
+
+void ImpProblem::predict(const shared_ptr<ImpData> &Ub, const ImpInt top_n,
+        vector<ImpLong> &items, Vec &scores) {
+    const ImpLong mb = Ub->m;
+    vector<Vec> Pb(f*(f+1)/2);
+    Vec at(mb, 0);
+
+    for (ImpInt f1 = 0; f1 < fu; f1++) {
+        for (ImpInt f2 = f1; f2 < f; f2++) {
+            const ImpInt f12 = index_vec(f1, f2, f);
+            if (!has_block(f12))
+                continue;
+            Pb[f12].resize(mb*k);
+            project(Ub->Xs[f1], mb, f12, false, Pb[f12]);
+            if (f2 < fu) {
+                Vec Qb(mb*k);
+                project(Ub->Xs[f2], mb, f12, true, Qb);
+                add_side(Pb[f12], Qb, mb, at);
+            }
+        }
+    }
+
+    const ImpLong nr_top = min<ImpLong>(top_n, n);
+    if (index == nullptr && qbytes > 0)
+        rank_items_q(Pb, mb, top_n, items, scores);
+    else if (index == nullptr)
+        rank_items(Pb, Qva, 0, mb, n, top_n, items, scores);
+    else {
+        items.resize(mb*nr_top);
+        scores.resize(mb*nr_top);
+#pragma omp parallel
+        {
+            const ImpLong dim = fu*fv*k+1;
+            Vec q(dim);
+            vector<pair<ImpDouble, ImpLong>> order, heap;
+#pragma omp for schedule(dynamic, 16)
+            for (ImpLong i = 0; i < mb; i++) {
+                for (ImpInt f1 = 0, c = 0; f1 < fu; f1++)
+                    for (ImpInt f2 = fu; f2 < f; f2++, c++)
+                        copy(Pb[index_vec(f1, f2, f)].begin()+i*k,
+                                Pb[index_vec(f1, f2, f)].begin()+(i+1)*k, q.begin()+c*k);
+                q[dim-1] = 1;
+                index->search(q.data(), nr_top, nr_probe, order, heap);
+                for (ImpLong t = 0; t < nr_top; t++) {
+                    items[i*nr_top+t] = heap[t].second;
+                    scores[i*nr_top+t] = heap[t].first;
                 }
             }
+        }
+    }
+
+    for (ImpLong i = 0; i < mb; i++)
+        for (ImpLong t = 0; t < nr_top; t++)
+            scores[i*nr_top+t] += at[i];
+}
 
-            if( ImpInt(Uva->Y[i+1] - Uva->Y[i]) > valid_count )
-                idcg_score[state] += 1.0 / log2(valid_count + 2);
-            valid_count++;
+// Adds, at each K of param->top_k, the hits and the nDCG of the top items
+// of the labeled users of Ub; returns the number of labeled users.
+ImpLong ImpProblem::evaluate(const shared_ptr<ImpData> &Ub, vector<ImpLong> &hits,
+        vector<ImpDouble> &dcg) {
+    top_k = param->top_k;
+    const ImpInt nr_th = param->nr_threads, nr_k = top_k.size();
+    const ImpInt max_k = *max_element(top_k.begin(), top_k.end());
+    vector<ImpLong> items;
+    Vec scores;
+    predict(Ub, max_k, items, scores);
+    const ImpLong nr_top = (Ub->m > 0)? items.size()/Ub->m: 0;
+
+    vector<ImpLong> hit_counts(nr_th*nr_k, 0);
+    vector<ImpDouble> ndcg_scores(nr_th*nr_k, 0);
+    ImpLong nr_users = 0;
+#pragma omp parallel reduction(+: nr_users)
+{
+    vector<ImpLong> top, labels;
+#pragma omp for schedule(static)
+    for (ImpLong i = 0; i < Ub->m; i++) {
+        labels.assign(Ub->Y.idx+Ub->Y.ptr[i], Ub->Y.idx+Ub->Y.ptr[i+1]);
+        if (labels.empty())
+            continue;
+        sort(labels.begin(), labels.end());
+        top.assign(items.begin()+i*nr_top, items.begin()+(i+1)*nr_top);
+        prec_k(top, labels, hit_counts);
+        ndcg(top, labels, i, ndcg_scores);
+        nr_users++;
+    }
+}
+    hits.resize(nr_k, 0);
+    dcg.resize(nr_k, 0);
+    for (ImpInt s = 0; s < nr_k; s++) {
+        for (ImpInt th = 0; th < nr_th; th++) {
+            hits[s] += hit_counts[s+th*nr_k];
+            dcg[s] += ndcg_scores[s+th*nr_k];
         }
     }
+    return nr_users;
+}
 
-#ifdef EBUG_nDCG
-#ifndef SHOW_SCORE_ONLY
-    cout << endl;
-    cout << dcg_score[0] << ", " << idcg_score[0] << endl;
-#endif
-#endif
-    for (ImpInt i = 1; i < nr_k; i++) {
-        dcg_score[i] += dcg_score[i-1];
-        idcg_score[i] += idcg_score[i-1];
+void ImpProblem::prec_k(const vector<ImpLong> &top, const vector<ImpLong> &labels,
+        vector<ImpLong> &hit_counts) {
+    const ImpInt nr_k = top_k.size();
+    const ImpInt num_th = omp_get_thread_num();
+    ImpLong hit_count = 0;
+
+    ImpLong t = 0;
+    for (ImpInt s = 0; s < nr_k; s++) {
+        const ImpLong end = min<ImpLong>(top_k[s], top.size());
+        for (; t < end; t++)
+            if (binary_search(labels.begin(), labels.end(), top[t]))
+                hit_count++;
+        hit_counts[s+num_th*nr_k] += hit_count;
     }
+}
 
-    for (ImpInt i = 0; i < nr_k; i++) {
-        ndcg_scores[i+num_th*nr_k] += dcg_score[i] / idcg_score[i];
+void ImpProblem::ndcg(const vector<ImpLong> &top, const vector<ImpLong> &labels,
+        ImpLong i, vector<ImpDouble> &ndcg_scores) {
+    const ImpInt nr_k = top_k.size();
+    const ImpInt num_th = omp_get_thread_num();
+    const ImpLong nr_labels = labels.size();
+    ImpDouble dcg = 0, idcg = 0;
+
+    ImpLong t = 0;
+    for (ImpInt s = 0; s < nr_k; s++) {
+        const ImpLong end = min<ImpLong>(top_k[s], top.size());
+        for (; t < end; t++) {
+            const ImpDouble gain = 1.0 / log2(t + 2);
+            if (binary_search(labels.begin(), labels.end(), top[t]))
+                dcg += gain;
+            if (nr_labels > t)
+                idcg += gain;
+        }
+        ndcg_scores[s+num_th*nr_k] += dcg / idcg;
     }
+
 #ifdef EBUG_nDCG
-    cout << setprecision(4) << dcg_score[1] / idcg_score[1] << endl;
+#ifndef SHOW_SCORE_ONLY
+    cout << i << ":";
+    for (ImpLong t = 0; t < min<ImpLong>(10, top.size()); t++)
+        cout << top[t] << " ";
+    cout << "(";
+    for (ImpLong j : labels)
+        cout << j << ",";
+    cout << ")" << endl;
+#endif
+    cout << setprecision(4) << ndcg_scores[1+num_th*nr_k] << endl;
 #endif
 }
 
@@ -1145,32 +3483,84 @@ void ImpProblem::print_epoch_info(ImpInt t) {
 }
 
 void ImpProblem::solve() {
-    init_va(5);
-    for (ImpInt iter = 0; iter < param->nr_pass; iter++) {
+    init_va();
+    epochs_done = epoch0;
+    for (ImpInt iter = epoch0; iter < param->nr_pass; iter++) {
 #ifdef EBUG_nDCG
             cout << "DEBUG nDCG" << endl;
             validate();
 #else
-            one_epoch();
-            if (!Uva->file_name.empty() && iter % 10 == 9) {
+            const ImpDouble t0 = omp_get_wtime();
+            if (param->jacobi)
+                one_epoch_jacobi();
+            else
+                one_epoch();
+            const ImpDouble t1 = omp_get_wtime();
+            if (param->show_obj) {
+                const ImpDouble obj = objective();
+                cout << "epoch " << iter+1 << "  obj " << setprecision(8) << obj
+                    << "  time " << setprecision(3) << t1-t0 << endl;
+                if (tel != nullptr)
+                    tel->put("obj", obj);
+            }
+            epochs_done = iter+1;
+            bool stop = false;
+            if (!Uva->file_name.empty() && (iter+1) % param->eval_every == 0) {
                 validate();
                 print_epoch_info(iter);
+                stop = (stop_kind != 0 && early_stop(iter));
+                if (tel != nullptr) {
+                    tel->put("va_loss", loss);
+                    for (ImpInt i = 0; i < ImpInt(top_k.size()); i++) {
+                        tel->put("p@" + to_string(top_k[i]), va_loss_prec[i]);
+                        tel->put("ndcg@" + to_string(top_k[i]), va_loss_ndcg[i]);
+                    }
+                }
             }
+            if (tel != nullptr)
+                tel->flush(iter+1, t1-t0);
+            if (!param->checkpoint_path.empty() && (iter+1) % param->checkpoint_every == 0)
+                checkpoint(iter+1);
+            if (stop)
+                break;
 #endif
     }
+    if (ckpt_writer.joinable())
+        ckpt_writer.join();
+    if (best_epoch > 0 && best_epoch != epochs_done) {
+        cout << "best epoch " << best_epoch << endl;
+        W.swap(W_best);
+        H.swap(H_best);
+        epochs_done = best_epoch;
+    }
+}
+
+// Hash bits of the user fields, then of the item fields, 0 where a field
+// is not hashed.
+vector<ImpLong> ImpProblem::model_hash_bits() const {
+    vector<ImpLong> bits(f, 0);
+    for (ImpInt fi = 0; fi < fu && fi < U->hash_bits.size(); fi++)
+        bits[fi] = U->hash_bits[fi];
+    for (ImpInt fi = 0; fi < fv && fi < V->hash_bits.size(); fi++)
+        bits[fu+fi] = V->hash_bits[fi];
+    return bits;
 }
 
+// A hashed field is written as h<bits> in place of its Ds.
 void ImpProblem::write_header(ofstream &f_out) const{
     f_out << f << endl;
     f_out << fu << endl;
     f_out << fv << endl;
     f_out << k << endl;
-    
-    for(ImpInt fi = 0; fi < fu ; fi++)
-        f_out << U->Ds[fi] << endl;
-    
-    for(ImpInt fi = 0; fi < fv ; fi++)
-        f_out << V->Ds[fi] << endl;
+
+    const vector<ImpLong> bits = model_hash_bits();
+    for(ImpInt fi = 0; fi < f ; fi++)
+    {
+        if(bits[fi] > 0)
+            f_out << 'h' << bits[fi] << endl;
+        else
+            f_out << ((fi < fu)? U->Ds[fi]: V->Ds[fi-fu]) << endl;
+    }
 }
 
 void write_block(const Vec& block, const ImpLong& num_of_rows, const ImpInt& num_of_columns, char block_type, const ImpInt fi, const ImpInt fj, ofstream &f_out){
@@ -1190,7 +3580,7 @@ void write_block(const Vec& block, const ImpLong& num_of_rows, const ImpInt& num
         for(ImpInt col_i = 0; col_i < num_of_columns ; col_i++ ){
             f_out << " " <<block[offset + col_i];
         }
-        f_out << endl;
+        f_out << '\n';
     }
 }
 
@@ -1236,75 +3626,294 @@ void save_model(const ImpProblem& prob, string & model_path ){
     prob.write_W_and_H( f_out );  
 }
 
-void ImpProblem::save_binary_model(string & model_path){
+void ImpProblem::read_header(ifstream &f_in) {
+    f_in >> f >> fu >> fv >> k;
+
+    U->Ds.resize(fu);
+    V->Ds.resize(fv);
+    U->hash_bits.assign(fu, 0);
+    V->hash_bits.assign(fv, 0);
+    for(ImpInt fi = 0; fi < f ; fi++)
+    {
+        ImpLong &ds = (fi < fu)? U->Ds[fi]: V->Ds[fi-fu];
+        ImpInt &bits = (fi < fu)? U->hash_bits[fi]: V->hash_bits[fi-fu];
+        f_in >> ws;
+        if(f_in.peek() == 'h')
+        {
+            f_in.get();
+            f_in >> bits;
+            ds = ImpLong(1) << bits;
+        }
+        else
+            f_in >> ds;
+    }
+    f_in.ignore(numeric_limits<streamsize>::max(), '\n');
+}
+
+void ImpProblem::read_W_and_H(ifstream &f_in) {
+    const ImpInt nr_blocks = f*(f+1)/2;
+    W.resize(nr_blocks);
+    H.resize(nr_blocks);
+    param->self_side = false;
+
+    string line;
+    while (getline(f_in, line)) {
+        const char *p = line.data()+2, *end = line.data()+line.size();
+        ImpLong fi, fj, row;
+        if (line.size() < 2 || !parse_uint(p, end, fi) || ++p >= end
+                || !parse_uint(p, end, fj) || ++p >= end
+                || !parse_uint(p, end, row) || fj >= f || fi > fj)
+            throw invalid_argument("invalid model line: " + line);
+
+        const ImpInt f12 = index_vec(fi, fj, f);
+        const ImpInt fb = (line[0] == 'W')? fi: fj;
+        const ImpLong Df = (fb < fu)? U->Ds[fb]: V->Ds[fb-fu];
+        Vec &block = (line[0] == 'W')? W[f12]: H[f12];
+        if (block.empty())
+            block.resize(Df*k, 0);
+        if (row >= Df)
+            throw invalid_argument("invalid model line: " + line);
+        if (fi >= fu || fj < fu)
+            param->self_side = true;
+
+        for (ImpInt d = 0; d < k; d++) {
+            while (p < end && is_blank(*p))
+                p++;
+            ImpDouble val;
+            if (!parse_real(p, end, val))
+                throw invalid_argument("invalid model line: " + line);
+            block[row*k+d] = val;
+        }
+    }
+}
+
+void load_model(ImpProblem& prob, string & model_path ){
+    char magic[sizeof(MODEL_MAGIC)] = {0};
+    ifstream f_bin(model_path, ios::binary);
+    f_bin.read(magic, sizeof(magic));
+    if (equal(MODEL_MAGIC, MODEL_MAGIC+sizeof(MODEL_MAGIC), magic)) {
+        prob.load_binary_model(model_path);
+        return;
+    }
+
+    ifstream f_in(model_path);
+    if (!f_in.is_open())
+        throw invalid_argument("cannot open model " + model_path);
+    prob.read_header( f_in );
+    prob.read_W_and_H( f_in );
+}
+
+// Binary model: magic, header {version, scalar size, f, fu, fv, k, epochs},
+// Ds of the user and item fields, their hash bits (from version 3), then
+// one {W rows, H rows} entry per block followed by the blocks themselves;
+// every section is 64-byte aligned so the blocks can be used in place from
+// a read-only mapping.
+bool write_binary_model(const string &model_path, const vector<ImpLong> &head,
+        const vector<ImpLong> &ds_u, const vector<ImpLong> &ds_v, const vector<ImpLong> &hash,
+        const vector<Vec> &W, const vector<Vec> &H) {
     ofstream of(model_path, ios::binary | ios::trunc );
-    of.write( reinterpret_cast<char*>(&f), sizeof(ImpInt) );
-    of.write( reinterpret_cast<char*>(&fu), sizeof(ImpInt) );
-    of.write( reinterpret_cast<char*>(&fv), sizeof(ImpInt) );
-    of.write( reinterpret_cast<char*>(&k), sizeof(ImpInt) );
-    
-    of.write( reinterpret_cast<char*>(U->Ds.data()), sizeof(ImpLong)*fu);
-    of.write( reinterpret_cast<char*>(V->Ds.data()), sizeof(ImpLong)*fv);
-    
-    for(ImpInt fi = 0; fi < f ; fi++){
-        for(ImpInt fj = fi; fj < f; fj++){
-            ImpInt fij = index_vec(fi, fj, f);
-            if( !param->self_side && !(fi < fu && fj >= fu) )
-                continue;
-            
-            ImpLong Wij_size = W[fij].size();
-            ImpLong Hij_size = H[fij].size();
-            of.write( reinterpret_cast<char*>(&fij), sizeof(ImpInt) );
-            of.write( reinterpret_cast<char*>(&Wij_size), sizeof(ImpLong) );
-            of.write( reinterpret_cast<char*>(&Hij_size), sizeof(ImpLong) );
+    const ImpInt nr_blocks = W.size();
+    const ImpLong k = head[5];
+    write_array(of, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    write_array(of, head.data(), head.size());
+    write_array(of, ds_u.data(), ds_u.size());
+    write_array(of, ds_v.data(), ds_v.size());
+    write_array(of, hash.data(), hash.size());
+
+    vector<ImpLong> rows(2*nr_blocks, 0);
+    for (ImpInt f12 = 0; f12 < nr_blocks; f12++) {
+        rows[2*f12] = W[f12].size()/k;
+        rows[2*f12+1] = H[f12].size()/k;
+    }
+    write_array(of, rows.data(), 2*nr_blocks);
+
+    for (ImpInt f12 = 0; f12 < nr_blocks; f12++) {
+        write_array(of, W[f12].data(), W[f12].size());
+        write_array(of, H[f12].data(), H[f12].size());
+    }
+    return of.good();
+}
 
-            of.write( reinterpret_cast<char*>(W[fij].data()), sizeof(ImpDouble)*Wij_size );
-            of.write( reinterpret_cast<char*>(H[fij].data()), sizeof(ImpDouble)*Hij_size );
+void ImpProblem::save_binary_model(string & model_path){
+    const vector<ImpLong> head = {MODEL_VERSION, sizeof(ImpFloat), f, fu, fv, k, epochs_done};
+    if (!write_binary_model(model_path, head, U->Ds, V->Ds, model_hash_bits(), W, H))
+        throw invalid_argument("fail to write model " + model_path);
+}
+
+template <typename T>
+void write_quantized(ofstream &of, const ImpFloat *A, const ImpLong rows, const ImpLong k) {
+    vector<T> q(rows*k);
+    vector<float> scale(rows);
+#pragma omp parallel for schedule(static)
+    for (ImpLong r = 0; r < rows; r++)
+        quantize_row(A+r*k, k, q.data()+r*k, scale[r]);
+    write_array(of, q.data(), q.size());
+    write_array(of, scale.data(), rows);
+}
+
+// The binary model with each block's W and H values followed by their row
+// scales; see QUANT_INT8.
+void ImpProblem::save_quantized_model(const string &model_path, const ImpLong bytes) {
+    if (qbytes > 0)
+        throw invalid_argument("the model is already quantized");
+    if (bytes != QUANT_INT8 && bytes != QUANT_FP16)
+        throw invalid_argument("models quantize to int8 or fp16 only");
+    const ImpInt nr_blocks = f*(f+1)/2;
+    const bool mapped = !Wm.empty();
+    vector<ImpLong> rows(2*nr_blocks, 0);
+    vector<const ImpFloat*> A(2*nr_blocks, nullptr);
+    for (ImpInt f1 = 0; f1 < f; f1++) {
+        for (ImpInt f2 = f1; f2 < f; f2++) {
+            const ImpInt f12 = index_vec(f1, f2, f);
+            if (mapped? Wm[f12] == nullptr: W[f12].empty())
+                continue;
+            A[2*f12] = mapped? Wm[f12]: W[f12].data();
+            A[2*f12+1] = mapped? Hm[f12]: H[f12].data();
+            rows[2*f12] = (f1 < fu)? U->Ds[f1]: V->Ds[f1-fu];
+            rows[2*f12+1] = (f2 < fu)? U->Ds[f2]: V->Ds[f2-fu];
         }
     }
-    of.close();
 
+    const vector<ImpLong> head = {MODEL_VERSION, bytes, f, fu, fv, k, epoch0};
+    ofstream of(model_path, ios::binary | ios::trunc);
+    write_array(of, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    write_array(of, head.data(), head.size());
+    write_array(of, U->Ds.data(), fu);
+    write_array(of, V->Ds.data(), fv);
+    write_array(of, model_hash_bits().data(), f);
+    write_array(of, rows.data(), 2*nr_blocks);
+    for (ImpInt b = 0; b < 2*nr_blocks; b++) {
+        if (bytes == QUANT_INT8)
+            write_quantized<int8_t>(of, A[b], rows[b], k);
+        else
+            write_quantized<Half>(of, A[b], rows[b], k);
+    }
+    if (!of.good())
+        throw invalid_argument("fail to write model " + model_path);
+}
+
+// Written next to the checkpoint and renamed over it, so a crash while
+// writing leaves the previous checkpoint intact.
+void write_checkpoint(const string path, const vector<ImpLong> head,
+        const vector<ImpLong> ds_u, const vector<ImpLong> ds_v, const vector<ImpLong> hash,
+        const vector<Vec> W, const vector<Vec> H) {
+    const string tmp = path + ".tmp";
+    if (!write_binary_model(tmp, head, ds_u, ds_v, hash, W, H)
+            || rename(tmp.c_str(), path.c_str()) != 0)
+        cerr << "fail to write checkpoint " << path << endl;
+}
+
+// Snapshots W and H after the given number of epochs and writes them in the
+// background while training goes on; at most one write is in flight.
+void ImpProblem::checkpoint(const ImpInt epochs) {
+    if (ckpt_writer.joinable())
+        ckpt_writer.join();
+    if (mpi_rank() != 0)
+        return;
+    const vector<ImpLong> head = {MODEL_VERSION, sizeof(ImpFloat), f, fu, fv, k, epochs};
+    ckpt_writer = thread(write_checkpoint, param->checkpoint_path, head, U->Ds, V->Ds,
+            model_hash_bits(), W, H);
+}
+
+// A model saved in the other precision is converted into W and H.
+void convert_block(const char *src, const ImpLong scalar, const ImpLong count, Vec &block) {
+    if (scalar == sizeof(float)) {
+        const float *p = reinterpret_cast<const float*>(src);
+        block.assign(p, p+count);
+    }
+    else {
+        const double *p = reinterpret_cast<const double*>(src);
+        block.assign(p, p+count);
+    }
 }
 
 void ImpProblem::load_binary_model(string & model_path){
-    ofstream ifile(model_path, ios::binary | ios::trunc );
-    ifile.write( reinterpret_cast<char*>(&f), sizeof(ImpInt) );
-    ifile.write( reinterpret_cast<char*>(&fu), sizeof(ImpInt) );
-    ifile.write( reinterpret_cast<char*>(&fv), sizeof(ImpInt) );
-    ifile.write( reinterpret_cast<char*>(&k), sizeof(ImpInt) );
-    
-    W.resize(f*(f+1)/2);
-    H.resize(f*(f+1)/2);
-    U->Ds.resize(fu);
-    V->Ds.resize(fv);
-    ifile.write( reinterpret_cast<char*>(U->Ds.data()), sizeof(ImpLong)*fu);
-    ifile.write( reinterpret_cast<char*>(V->Ds.data()), sizeof(ImpLong)*fv);
-    
-    for(ImpInt fi = 0; fi < f ; fi++){
-        for(ImpInt fj = fi; fj < f; fj++){
-            ImpInt fij = index_vec(fi, fj, f);
-            if( !param->self_side && !(fi < fu && fj >= fu) )
-                continue;
-            
-            ImpLong Wij_size, Hij_size;
-            ifile.write( reinterpret_cast<char*>(&fij), sizeof(ImpInt) );
-            ifile.write( reinterpret_cast<char*>(&Wij_size), sizeof(ImpLong) );
-            ifile.write( reinterpret_cast<char*>(&Hij_size), sizeof(ImpLong) );
+    model_map = make_shared<ImpMap>(model_path, false);
+    if (model_map->addr == nullptr)
+        throw invalid_argument("cannot open model " + model_path);
+
+    size_t offset = 0;
+    const char *magic = map_array<char>(model_map, offset, sizeof(MODEL_MAGIC));
+    // A version 1 header has no epochs but is padded to the same size.
+    const ImpLong *head = map_array<ImpLong>(model_map, offset, 7);
+    if (magic == nullptr || head == nullptr
+            || !equal(MODEL_MAGIC, MODEL_MAGIC+sizeof(MODEL_MAGIC), magic))
+        throw invalid_argument(model_path + " is not a binary model");
+    const ImpLong scalar = head[1];
+    const bool quantized = (scalar == QUANT_INT8 || scalar == QUANT_FP16);
+    if (head[0] < 1 || head[0] > MODEL_VERSION
+            || (scalar != sizeof(float) && scalar != sizeof(double) && !quantized))
+        throw invalid_argument(model_path + ": unsupported model version or precision");
+    f = head[2]; fu = head[3]; fv = head[4]; k = head[5];
+    epoch0 = (head[0] >= 2)? head[6]: 0;
+
+    const ImpInt nr_blocks = f*(f+1)/2;
+    const ImpLong *ds_u = map_array<ImpLong>(model_map, offset, fu);
+    const ImpLong *ds_v = map_array<ImpLong>(model_map, offset, fv);
+    const ImpLong *hash = (head[0] >= 3)? map_array<ImpLong>(model_map, offset, f): nullptr;
+    const ImpLong *rows = map_array<ImpLong>(model_map, offset, 2*nr_blocks);
+    if (ds_u == nullptr || ds_v == nullptr || (head[0] >= 3 && hash == nullptr) || rows == nullptr)
+        throw invalid_argument(model_path + " is truncated");
+    U->Ds.assign(ds_u, ds_u+fu);
+    V->Ds.assign(ds_v, ds_v+fv);
+    U->hash_bits.assign(fu, 0);
+    V->hash_bits.assign(fv, 0);
+    if (hash != nullptr) {
+        copy(hash, hash+fu, U->hash_bits.begin());
+        copy(hash+fu, hash+f, V->hash_bits.begin());
+    }
 
-            W[fij].resize(Wij_size);
-            H[fij].resize(Hij_size);
-            ifile.write( reinterpret_cast<char*>(W[fij].data()), sizeof(ImpDouble)*Wij_size );
-            ifile.write( reinterpret_cast<char*>(H[fij].data()), sizeof(ImpDouble)*Hij_size );
+    W.assign(nr_blocks, Vec());
+    H.assign(nr_blocks, Vec());
+    Wm.assign(nr_blocks, nullptr);
+    Hm.assign(nr_blocks, nullptr);
+    qbytes = quantized? scalar: 0;
+    Wq.assign(quantized? nr_blocks: 0, QBlock());
+    Hq.assign(quantized? nr_blocks: 0, QBlock());
+    param->self_side = false;
+    for (ImpInt f12 = 0; quantized && f12 < nr_blocks; f12++) {
+        QBlock w, h;
+        w.bytes = h.bytes = scalar;
+        w.q = map_array<char>(model_map, offset, rows[2*f12]*k*scalar);
+        w.scale = map_array<float>(model_map, offset, rows[2*f12]);
+        h.q = map_array<char>(model_map, offset, rows[2*f12+1]*k*scalar);
+        h.scale = map_array<float>(model_map, offset, rows[2*f12+1]);
+        if (w.q == nullptr || w.scale == nullptr || h.q == nullptr || h.scale == nullptr)
+            throw invalid_argument(model_path + " is truncated");
+        if (rows[2*f12] == 0)
+            continue;
+        Wq[f12] = w;
+        Hq[f12] = h;
+    }
+    for (ImpInt f12 = 0; !quantized && f12 < nr_blocks; f12++) {
+        const char *w = map_array<char>(model_map, offset, rows[2*f12]*k*scalar);
+        const char *h = map_array<char>(model_map, offset, rows[2*f12+1]*k*scalar);
+        if (w == nullptr || h == nullptr)
+            throw invalid_argument(model_path + " is truncated");
+        if (rows[2*f12] == 0)
+            continue;
+        if (scalar == sizeof(ImpFloat)) {
+            Wm[f12] = reinterpret_cast<const ImpFloat*>(w);
+            Hm[f12] = reinterpret_cast<const ImpFloat*>(h);
+        }
+        else {
+            convert_block(w, scalar, rows[2*f12]*k, W[f12]);
+            convert_block(h, scalar, rows[2*f12+1]*k, H[f12]);
+            Wm[f12] = W[f12].data();
+            Hm[f12] = H[f12].data();
         }
     }
-    ifile.close();
+    for (ImpInt f1 = 0; f1 < f; f1++)
+        for (ImpInt f2 = f1; f2 < f; f2++)
+            if ((f1 >= fu || f2 < fu) && has_block(index_vec(f1, f2, f)))
+                param->self_side = true;
 }
 
 ImpDouble ImpProblem::pq(const ImpInt &i, const ImpInt &j,const ImpInt &f1, const ImpInt &f2) {
     ImpInt f12 = index_vec(f1, f2, f);
     ImpInt Pi = (f1 < fu)? i : j;
     ImpInt Qj = (f2 < fu)? i : j;
-    ImpDouble  *pp = P[f12].data()+Pi*k, *qp = Q[f12].data()+Qj*k;
+    ImpFloat  *pp = P[f12].data()+Pi*k, *qp = Q[f12].data()+Qj*k;
     return inner(qp, pp, k);
 }
 
@@ -1329,8 +3938,8 @@ ImpDouble ImpProblem::func() {
                 }
             }
             bool pos_term = false;
-            for(Node* y = U->Y[i]; y < U->Y[i+1]; y++){
-                if ( y->idx == j ) {
+            for(ImpLong s = U->Y.ptr[i]; s < U->Y.ptr[i+1]; s++){
+                if ( U->Y.idx[s] == j ) {
                     pos_term = true;
                     break;
                 }
@@ -6,6 +6,10 @@
 #include <cstring>
 #include <stdlib.h>
 #include <unordered_set>
+#include <unordered_map>
+#include <map>
+#include <deque>
+#include <mutex>
 #include <algorithm>
 #include <functional>
 #include <iomanip>
@@ -13,7 +17,17 @@
 #include <utility>
 #include <numeric>
 #include <cassert>
-
+#include <thread>
+#include <limits>
+#include <stdexcept>
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <immintrin.h>
 
@@ -27,73 +41,354 @@
 #include <cblas.h>
 #endif
 
+#ifdef USEMPI
+#include <mpi.h>
+#endif
+
 
 
 using namespace std;
 
+// Storage scalar of data values, model blocks and solver buffers; sums that
+// need the range (inner products, CG scalars, metrics) stay in ImpDouble.
+#ifdef FLOAT32
+typedef float ImpFloat;
+#else
 typedef double ImpFloat;
+#endif
 typedef double ImpDouble;
 typedef unsigned int ImpInt;
 typedef unsigned long int ImpLong;
-typedef vector<ImpDouble> Vec;
+typedef uint32_t ImpIdx;
+
+// Out-of-core storage. While a DiskScope is active on a thread, its large
+// allocations come from unlinked scratch files under the directory given to
+// set_disk_dir, mapped shared, so the kernel reads them ahead and writes
+// them back and evicts them under memory pressure. Without a directory the
+// scope has no effect.
+const size_t DISK_MIN_BYTES = 1<<20;
+const ImpLong DISK_CHUNK = 1<<16;
+
+void set_disk_dir(const string &dir);
+void* disk_alloc(const size_t bytes);
+bool map_free(void *p);
+void prefetch(const void *p, const size_t bytes);
+
+class DiskScope {
+public:
+    explicit DiskScope(bool on);
+    ~DiskScope();
+private:
+    bool prev;
+};
 
-const int MIN_Z = -1000;
+// NUMA mode. Large allocations outside a DiskScope are mapped at huge page
+// boundaries, advised for transparent huge pages, and first touched by all
+// threads in a static partition, so each node holds the slice of every
+// array that a static row loop gives its threads. pin_threads binds thread
+// t of T to the (t*n/T)-th of the n allowed cores ordered by node.
+void set_numa(bool on);
+void* numa_alloc(const size_t bytes);
+void pin_threads();
+string numa_report(const vector<pair<const void*, size_t>> &blocks);
+
+// Solver telemetry: wall time, calls and estimated bytes touched per kernel,
+// in total and per (f1, f2) block, plus CG iterations and final residual
+// ratios per block. One JSON line is written per epoch. Kernels nest, so cg
+// includes its hs_side or hs_cross calls.
+struct KernelStat {
+    ImpDouble time = 0;
+    ImpLong calls = 0, bytes = 0;
+};
+
+struct BlockStat {
+    map<string, KernelStat> kernels;
+    ImpLong cg_calls = 0, cg_iters = 0, cg_capped = 0;
+    ImpDouble res_ratio = 0;
+};
+
+class Telemetry {
+public:
+    explicit Telemetry(const string &path);
+    void add(const char *kernel, const ImpDouble time, const ImpLong bytes);
+    void add_cg(const ImpInt nr_cg, const bool capped, const ImpDouble res_ratio);
+    void put(const string &key, const ImpDouble value);
+    void flush(const ImpInt epoch, const ImpDouble time);
+private:
+    ofstream out;
+    mutex lock;
+    map<string, KernelStat> kernels;
+    map<pair<ImpInt, ImpInt>, BlockStat> blocks;
+    vector<pair<string, ImpDouble>> values;
+};
+
+// Attributes the kernels run by this thread to block (f1, f2).
+class BlockScope {
+public:
+    BlockScope(const ImpInt f1, const ImpInt f2);
+    ~BlockScope();
+private:
+    pair<ImpInt, ImpInt> prev;
+    bool prev_in;
+};
+
+// Times one kernel call; does nothing without telemetry.
+class KernelTimer {
+public:
+    KernelTimer(const shared_ptr<Telemetry> &tel, const char *kernel, const ImpLong bytes=0);
+    ~KernelTimer();
+    void add_bytes(const ImpLong more) { bytes += more; }
+private:
+    Telemetry *tel;
+    const char *kernel;
+    ImpLong bytes;
+    ImpDouble t0;
+};
+
+template <typename T>
+class ImpAllocator {
+public:
+    typedef T value_type;
+    ImpAllocator() {};
+    template <typename U> ImpAllocator(const ImpAllocator<U>&) {};
+    T* allocate(size_t count) {
+        const size_t bytes = count*sizeof(T);
+        void *p = (bytes >= DISK_MIN_BYTES)? disk_alloc(bytes): nullptr;
+        if (p == nullptr && bytes >= DISK_MIN_BYTES)
+            p = numa_alloc(bytes);
+        if (p == nullptr && posix_memalign(&p, 64, bytes) != 0)
+            throw bad_alloc();
+        return static_cast<T*>(p);
+    }
+    void deallocate(T *p, size_t count) {
+        const size_t bytes = count*sizeof(T);
+        if (bytes < DISK_MIN_BYTES || !map_free(p))
+            free(p);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const ImpAllocator<T>&, const ImpAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const ImpAllocator<T>&, const ImpAllocator<U>&) { return false; }
+
+typedef vector<ImpFloat, ImpAllocator<ImpFloat>> Vec;
+
+// Solver temporaries. Each thread keeps a stack of arrays; a Workspace takes
+// the next ones, filled with v, and gives them all back when it goes out of
+// scope. The arrays keep their capacity, so once a call path has run it
+// takes its temporaries without heap allocation. Vec arrays are 64-byte
+// aligned. User-sized arrays pass disk and come from a separate stack
+// allocated under a DiskScope, so out of core they live in scratch files.
+class Workspace {
+public:
+    Workspace();
+    ~Workspace();
+    Workspace(const Workspace&) = delete;
+    Vec& vec(const size_t n, const ImpFloat v=0, const bool disk=false);
+    vector<ImpDouble>& dvec(const size_t n);
+    vector<ImpLong>& lvec(const size_t n);
+private:
+    size_t nr_vecs, nr_disk_vecs, nr_dvecs, nr_lvecs;
+};
+
+const ImpInt DATA_CACHE_VERSION = 3;
+const ImpInt MODEL_VERSION = 3;
+
+// Quantized models store the scalar size of their rows, 1 for int8 or 2
+// for fp16, where the other binary models store sizeof(ImpFloat). Row r of
+// a block is scale[r] times its k values; int8 rows take scale max|x|/127
+// and fp16 rows max|x|, which keeps fp16 values out of the subnormals.
+const ImpLong QUANT_INT8 = 1, QUANT_FP16 = 2;
+
+struct QBlock {
+    ImpLong bytes = 0;
+    const void *q = nullptr;
+    const float *scale = nullptr;
+};
+
+const ImpLong SCORE_USER_TILE = 64;
+const ImpLong SCORE_ITEM_TILE = 512;
+const ImpLong VA_BATCH_SIZE = 16384;
+
+// Ranks of a data-parallel run over MPI and in-place reductions across
+// them. Without USEMPI there is a single rank and the reductions do nothing.
+ImpInt mpi_rank();
+ImpInt mpi_size();
+void sum_all(float *buf, const ImpLong count);
+void sum_all(double *buf, const ImpLong count);
+void sum_all(ImpLong *buf, const ImpLong count);
+void max_all(ImpLong *buf, const ImpLong count);
+void min_all(ImpLong *buf, const ImpLong count);
 
 class Parameter {
 public:
-    ImpFloat omega, lambda, r;
+    ImpDouble omega, lambda, r;
     ImpInt nr_pass, k, nr_threads;
     string model_path, predict_path;
-    bool self_side, freq = false;
+    bool self_side, freq = false, jacobi = false, show_obj = false;
+    string ooc_path, checkpoint_path, warm_path, telemetry_path;
+    ImpInt checkpoint_every = 1;
+    bool resume = false, fold_in = false, numa = false;
+    ImpDouble cg_eps = 9e-2;
+    ImpInt max_cg = 20;
+    bool cg_precond = false, cg_warm = false;
+    ImpDouble precond_shift = 1e4;
+    vector<ImpInt> top_k = {5, 10, 20, 40, 80};
+    ImpInt eval_every = 10, patience = 3;
+    ImpLong va_sample = 0;
+    string early_stop;
     Parameter():omega(0.1), lambda(1e-5), r(-1), nr_pass(20), k(4), nr_threads(1), self_side(true) {};
 };
 
-class Node {
+// Compressed sparse rows: row i holds idx[ptr[i]..ptr[i+1]) and the same
+// range of val. Only the row offsets are 64-bit. The arrays are owned by
+// the CSR, or point into a mapped cache.
+class CSR {
 public:
-    ImpInt fid;
-    ImpLong idx;
-    ImpDouble val;
-    Node(): fid(0), idx(0), val(0) {};
+    ImpLong nr_rows;
+    ImpLong *ptr;
+    ImpIdx *idx;
+    ImpFloat *val;
+
+    CSR(): nr_rows(0), ptr(nullptr), idx(nullptr), val(nullptr) {};
+    CSR(const CSR&) = delete;
+    CSR(CSR&&) = default;
+    CSR& operator=(CSR&&) = default;
+    void resize(const ImpLong nr_rows, const ImpLong nnz);
+    void clear();
+    ImpLong nnz() const { return (ptr == nullptr)? 0: ptr[nr_rows]; }
+    void to_disk();
+private:
+    vector<ImpLong, ImpAllocator<ImpLong>> ptrs;
+    vector<ImpIdx, ImpAllocator<ImpIdx>> idxs;
+    Vec vals;
+};
+
+// Mapping of a whole file: private and writable (writes never reach the
+// disk), or shared and read-only so processes share the page cache.
+class ImpMap {
+public:
+    char *addr;
+    size_t size;
+    ImpMap(const string &path, bool writable=true);
+    ~ImpMap();
 };
 
 class ImpData {
 public:
     string file_name;
     ImpLong m, n, f, nnz_x, nnz_y;
+    ImpInt nr_parts;
     vector<ImpLong> nnx, nny;
-    vector<Node> M, N;
-    vector<Node*> X, Y;
-
+    CSR X, Y;
+    vector<ImpIdx> fids;
 
-    vector<vector<Node>> Ns;
-    vector<vector<Node*>> Xs;
+    vector<CSR> Xs, XTs;
     vector<ImpLong> Ds;
+    // After restrict_fields, row t of Xs[fi] is row rows[fi][t] of the data
+    // and XTs[fi] indexes rows by t.
+    vector<vector<ImpLong>> rows;
+    // Fields with hash_bits[fi] > 0 map each index to one of 2^bits buckets
+    // while parsing, so their Ds is fixed whatever ids the data holds.
+    vector<ImpInt> hash_bits;
     vector<vector<ImpLong>> freq;
     vector<ImpDouble> popular;
 
-    ImpData(string file_name): file_name(file_name), m(0), n(0), f(0) {};
-    void read(bool has_label, const ImpLong* ds=nullptr);
+    shared_ptr<ImpMap> cache;
+
+    ImpData(string file_name): file_name(file_name), m(0), n(0), f(0), nr_parts(1) {};
+    void read(bool has_label, ImpInt nr_threads=1, ImpInt part=0, ImpInt nr_parts=1);
+    void parse(const char *begin, const char *end, bool has_label, ImpInt nr_threads=1);
     void print_data_info();
-    void split_fields();
-    void transY(const vector<Node*> &YT);
+    void split_fields(const vector<ImpLong> &ds=vector<ImpLong>());
+    void grow_fields(const vector<ImpLong> &ds);
+    void restrict_fields(const vector<ImpLong> &ds);
+    shared_ptr<ImpData> select_rows(const vector<ImpLong> &rows) const;
+    void transY(const CSR &YT);
+    void transpose_fields();
+
+    void write_cache(ofstream &o_f) const;
+    bool map_cache(const shared_ptr<ImpMap> &c, size_t &offset);
 };
 
+bool load_cache(const string &cache_path, vector<shared_ptr<ImpData>> &sets);
+void save_cache(const string &cache_path, const vector<shared_ptr<ImpData>> &sets);
+
+// Input helpers shared by train, predict and quantize.
+bool is_numerical(const char *str);
+vector<ImpInt> parse_top_k(const string &list);
+bool read_batch(istream &in, const ImpLong batch_size, string &buf);
+bool has_label_block(const string &buf);
+
+
+// Approximate maximum inner product search over item vectors. Items are
+// lifted by one coordinate, sqrt(M^2-|x|^2), onto a sphere of radius M,
+// where larger inner products mean nearer points, and k-means on the
+// lifted items splits them into inverted lists. A query ranks the lists by
+// distance to their centroids and scores the items of the nr_probe nearest
+// exactly, so nr_probe trades recall for latency; probing every list is
+// exact.
+class ItemIndex {
+public:
+    ItemIndex(const Vec &E, const ImpLong n, const ImpLong dim, const ImpInt nr_lists);
+    ImpInt nr_lists() const { return lists.size()-1; }
+    void search(const ImpFloat *q, const ImpInt top_n, const ImpInt nr_probe,
+            vector<pair<ImpDouble, ImpLong>> &order, vector<pair<ImpDouble, ImpLong>> &heap) const;
+private:
+    ImpLong dim;
+    Vec centroids, items;
+    vector<ImpDouble> c_sq;
+    vector<ImpLong> lists, ids;
+};
+
+// Rows of one field a solver step visits: all m1 rows, or under fold-in
+// only the listed ones, which Xs and XTs of the field index by position.
+struct RowSet {
+    const ImpLong *ids = nullptr;
+    ImpLong size = 0;
+    ImpLong operator[](const ImpLong t) const { return (ids == nullptr)? t: ids[t]; }
+};
+
+// Sums over all rows of one side that the cross steps take, for cross
+// blocks c, e in fu*fv order: gram[c*nc+e] = X_c^T X_e, o[c] the column
+// sums of X_c and so[c] those weighted by the side's self term (a or b),
+// whose total is self. Fold-in keeps them and moves them by the rows each
+// step changes.
+struct SideSums {
+    vector<vector<ImpDouble>> gram, o, so;
+    ImpDouble self = 0;
+};
 
 class ImpProblem {
+    friend class ImpBench;
 public:
     ImpProblem(shared_ptr<ImpData> &U, shared_ptr<ImpData> &Uva,
             shared_ptr<ImpData> &V, shared_ptr<Parameter> &param)
         :U(U), Uva(Uva), V(V), param(param) {};
+    ~ImpProblem();
 
     void init();
     void solve();
     ImpDouble func();
+    ImpDouble objective();
 
     void write_header(ofstream& o_f) const;
     void write_W_and_H(ofstream& o_f) const;
+    void read_header(ifstream& i_f);
+    void read_W_and_H(ifstream& i_f);
+    vector<ImpLong> model_hash_bits() const;
+
+    void init_predict();
+    void predict(const shared_ptr<ImpData> &Ub, const ImpInt top_n,
+            vector<ImpLong> &items, Vec &scores);
+    void export_items(const string &path);
+    void build_index(const ImpInt nr_lists, const ImpInt nr_probe);
 
     void save_binary_model(string& model_path);
     void load_binary_model(string& model_path);
+    void save_quantized_model(const string &model_path, const ImpLong bytes);
+    ImpLong evaluate(const shared_ptr<ImpData> &Ub, vector<ImpLong> &hits, vector<ImpDouble> &dcg);
 private:
     ImpDouble loss, lambda, w, r;
 
@@ -102,13 +397,38 @@ private:
 
     ImpInt k, fu, fv, f;
     ImpLong m, n;
-    ImpLong mt;
+    ImpLong m_all, mt;
 
     vector<Vec> W, H, P, Q, Pva, Qva;
-    Vec a, b, va_loss_prec, va_loss_ndcg, sa, sb;
+    shared_ptr<ImpMap> model_map;
+    vector<const ImpFloat*> Wm, Hm;
+    vector<QBlock> Wq, Hq;
+    ImpLong qbytes = 0;
+    Vec a, b, bt, sa, sb;
+    vector<ImpLong> nnz_u, nnz_v;
+    vector<ImpDouble> va_loss_prec, va_loss_ndcg;
 
     vector<ImpInt> top_k;
 
+    ImpInt epoch0 = 0;
+    vector<Vec> W0, H0;
+    vector<ImpLong> D0;
+    vector<bool> frozen;
+    // Under fold-in, twin[f1] holds the position in the other side's Y of
+    // each positive of the rows of field f1, from twin_ptr[f1][t].
+    vector<vector<ImpLong>> twin_ptr, twin;
+    SideSums sums[2];
+    shared_ptr<Telemetry> tel;
+    thread ckpt_writer;
+    ImpInt load_prior(const string &path);
+    void checkpoint(const ImpInt epochs);
+    void init_fold_in();
+    void init_sums();
+    void add_sums(const bool user_rows, const ImpInt c, const RowSet &rows, const ImpDouble sign,
+            const ImpInt e0=0);
+    RowSet rows_of(const ImpInt f1) const;
+    ImpInt cross_index(const ImpInt f12) const;
+
     void init_pair(const ImpInt &f12, const ImpInt &fi, const ImpInt &fj,
             const shared_ptr<ImpData> &d1, const shared_ptr<ImpData> &d2);
 
@@ -116,35 +436,72 @@ private:
     void calc_side();
     void init_y_tilde();
     ImpDouble calc_cross(const ImpLong &i, const ImpLong &j);
+    ImpDouble calc_cross(const vector<Vec> &Pu, const vector<Vec> &Qi, const ImpLong &i, const ImpLong &j);
 
-    void update_side(const bool &sub_type, const Vec &S, const Vec &Q1, Vec &W1, const vector<Node*> &X12, Vec &P1);
-    void update_cross(const bool &sub_type, const Vec &S, const Vec &Q1, Vec &W1, const vector<Node*> &X12, Vec &P1);
+    void update_side(const ImpInt &f1, const Vec &S, const Vec &Q1, Vec &W1, Vec &P1);
+    void update_cross(const ImpInt &f1, const ImpInt &f12, const Vec &S, const Vec &Q1, Vec &W1, Vec &P1);
 
-    void UTx(const Node *x0, const Node* x1, const Vec &A, ImpDouble *c);
-    void UTX(const vector<Node*> &X, ImpLong m1, const Vec &A, Vec &C);
+    void UTx(const CSR &X, const ImpLong i, const ImpFloat *A, ImpFloat *c);
+    void UTX(const CSR &X, ImpLong m1, const ImpFloat *A, Vec &C);
+    void UTX(const CSR &X, ImpLong m1, const QBlock &A, Vec &C);
+    void XTC(const CSR &XT, const Vec &C, Vec &G);
     void QTQ(const Vec &C, const ImpLong &l);
     ImpDouble pq(const ImpInt &i, const ImpInt &j,const ImpInt &f1, const ImpInt &f2);
     ImpDouble norm_block(const ImpInt &f1,const ImpInt &f2);
 
+    void add_reg(const ImpInt &f1, const Vec &W1, Vec &G);
     void solve_side(const ImpInt &f1, const ImpInt &f2);
     void gd_side(const ImpInt &f1, const Vec &W1, const Vec &Q1, Vec &G);
-    void hs_side(const ImpLong &m1, const ImpLong &n1, const Vec &S, Vec &HS, const Vec &Q1, const vector<Node*> &UX, const vector<Node*> &Y, Vec &Hv_);
+    void hs_side(const RowSet &rows, const ImpLong &n1, const Vec &S, Vec &HS, const Vec &Q1, const CSR &UX, const CSR &UXT, const vector<ImpLong> &nnz1, Vec &C);
 
     void solve_cross(const ImpInt &f1, const ImpInt &f2);
     void gd_cross(const ImpInt &f1, const ImpInt &f12, const Vec &Q1, const Vec &W1, Vec &G);
-    void hs_cross(const ImpLong &m1, const ImpLong &n1, const Vec &V, const Vec &VQTQ, Vec &Hv, const Vec &Q1, const vector<Node*> &UX, const vector<Node*> &Y, Vec &Hv_);
+    void hs_cross(const RowSet &rows, const Vec &V, const Vec &VQTQ, Vec &Hv, const Vec &Q1, const CSR &UX, const CSR &UXT, const CSR &Y, const bool item_rows, Vec &C);
 
-    void cg(const ImpInt &f1, const ImpInt &f2, Vec &W1, const Vec &Q1, const Vec &G, Vec &P1);
+    vector<Vec> S_last;
+    void precond(const ImpInt &f1, const ImpInt &f2, const Vec &Q1, const Vec &QTQ, Vec &M);
+    void cg(const ImpInt &f1, const ImpInt &f2, const bool second, Vec &W1, const Vec &Q1, const Vec &G, Vec &P1);
     void cache_sasb();
+    void cache_sasb_rows();
+    template <typename F>
+    void scatter_items(const Vec &P1, const F &coef, Vec &C);
 
 
     void one_epoch();
-    void init_va(ImpInt size);
-
-    void pred_z(const ImpLong i, ImpDouble *z);
+    void one_epoch_jacobi();
+    vector<Vec> jacobi_G, jacobi_S, jacobi_D;
+    void block_step(const ImpInt &f1, const ImpInt &f2, const bool second, Vec &G, Vec &S);
+    ImpDouble reg_norm(const ImpInt &f1, const Vec &S);
+    void sum_sq(const Vec &al, const Vec &be, const vector<const ImpFloat*> &L,
+            const vector<const ImpFloat*> &R, ImpDouble &all_sq, ImpDouble &pos_sq, ImpDouble &pos_sum);
+    void init_va();
+
+    char stop_kind = 0;
+    ImpInt stop_idx = 0, best_epoch = 0, bad_evals = 0, epochs_done = 0;
+    ImpDouble best_score = 0;
+    vector<Vec> W_best, H_best;
+    bool early_stop(const ImpInt iter);
+
+    shared_ptr<ItemIndex> index;
+    ImpInt nr_probe = 0;
+    ImpLong item_vectors(Vec &E);
+    bool has_block(const ImpInt f12) const;
+    void project(const CSR &X, const ImpLong m1, const ImpInt f12, const bool h_side, Vec &C);
+
+    // Item vectors of a quantized model, quantized themselves, one scale
+    // per item.
+    ImpLong e_dim = 0;
+    vector<int8_t, ImpAllocator<int8_t>> E8;
+    vector<uint16_t, ImpAllocator<uint16_t>> E16;
+    vector<float> Es;
+    void quantize_items();
+    void rank_items_q(const vector<Vec> &Pu, const ImpLong mu, const ImpInt top_n,
+            vector<ImpLong> &items, Vec &scores);
+    void rank_items(const vector<Vec> &Pu, const vector<Vec> &Qi, const ImpLong i0, const ImpLong i1,
+            const ImpLong n1, const ImpInt top_n, vector<ImpLong> &items, Vec &scores);
     void pred_items();
-    void prec_k(ImpDouble *z, ImpLong i, vector<ImpLong> &hit_counts);
-    void ndcg(ImpDouble *z, ImpLong i, vector<ImpDouble> &hit_counts);
+    void prec_k(const vector<ImpLong> &top, const vector<ImpLong> &labels, vector<ImpLong> &hit_counts);
+    void ndcg(const vector<ImpLong> &top, const vector<ImpLong> &labels, ImpLong i, vector<ImpDouble> &ndcg_scores);
     void validate();
     void print_epoch_info(ImpInt t);
 
@@ -152,3 +509,6 @@ private:
 
 
 void save_model(const ImpProblem & prob, string & model_path );
+void load_model(ImpProblem & prob, string & model_path );
+
+void select_top(const ImpDouble *z, const ImpLong n, const ImpInt top_n, vector<ImpLong> &top);
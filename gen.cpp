@@ -0,0 +1,174 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdlib>
+#include <cmath>
+
+using namespace std;
+
+// Synthetic data in the training format: an item file of feature lines,
+// and user files whose lines are "label,label fid:idx:val ...", where the
+// labels are the positive items. Items and feature ids are drawn from
+// power laws, so a few are popular and most are rare.
+struct Option {
+    long m = 100000, n = 10000, m_va = 0;
+    int fu = 3, fv = 2, nnz = 2;
+    long d = 10000;
+    double pos = 10, alpha = 1.1;
+    unsigned long seed = 1;
+    string dir;
+};
+
+string gen_help()
+{
+    return string(
+    "usage: gen [options] output_dir\n"
+    "\n"
+    "writes item.ffm, tr.ffm and va.ffm into output_dir\n"
+    "\n"
+    "options:\n"
+    "-m <users>: set number of training users (default 100000)\n"
+    "-n <items>: set number of items (default 10000)\n"
+    "-v <users>: set number of validation users (default m/10)\n"
+    "-u <fields>: set number of user fields (default 3)\n"
+    "-i <fields>: set number of item fields (default 2)\n"
+    "-d <features>: set number of features per field (default 10000)\n"
+    "-z <nnz>: set features per field of each row (default 2)\n"
+    "-p <positives>: set mean positives per user (default 10)\n"
+    "-a <alpha>: set power-law exponent of item and feature popularity (default 1.1)\n"
+    "-s <seed>: set random seed (default 1)\n"
+    );
+}
+
+Option parse_option(int argc, char **argv)
+{
+    if(argc == 1)
+        throw invalid_argument(gen_help());
+
+    Option option;
+    int i;
+    for(i = 1; i < argc-1; i++)
+    {
+        const string arg = argv[i];
+        if(arg.size() != 2 || arg[0] != '-')
+            break;
+        const char *val = argv[++i];
+        switch(arg[1])
+        {
+            case 'm': option.m = atol(val); break;
+            case 'n': option.n = atol(val); break;
+            case 'v': option.m_va = atol(val); break;
+            case 'u': option.fu = atoi(val); break;
+            case 'i': option.fv = atoi(val); break;
+            case 'd': option.d = atol(val); break;
+            case 'z': option.nnz = atoi(val); break;
+            case 'p': option.pos = atof(val); break;
+            case 'a': option.alpha = atof(val); break;
+            case 's': option.seed = strtoul(val, nullptr, 10); break;
+            default: throw invalid_argument("unknown option " + arg + "\n\n" + gen_help());
+        }
+    }
+    if(i != argc-1)
+        throw invalid_argument("output directory not specified");
+    if(argv[i][0] == '-')
+        throw invalid_argument(gen_help());
+    option.dir = argv[i];
+    if(option.m_va == 0)
+        option.m_va = max(1L, option.m/10);
+    if(option.m <= 0 || option.n <= 0 || option.d <= 0 || option.fu < 0 || option.fv < 0
+            || option.nnz <= 0 || option.pos < 1 || option.alpha <= 0)
+        throw invalid_argument("sizes, nnz and alpha should be positive, and positives at least 1");
+    return option;
+}
+
+// Draws 0..size-1 with probability proportional to (rank+1)^-alpha; ranks
+// are scattered over the ids so popular ids are not all small.
+class PowerLaw {
+public:
+    PowerLaw(const long size, const double alpha, mt19937_64 &engine): ids(size), cdf(size) {
+        double s = 0;
+        for(long r = 0; r < size; r++)
+            cdf[r] = s += pow(double(r+1), -alpha);
+        for(long r = 0; r < size; r++)
+            ids[r] = r;
+        shuffle(ids.begin(), ids.end(), engine);
+    }
+    long operator()(mt19937_64 &engine) {
+        const double u = uniform_real_distribution<double>(0, cdf.back())(engine);
+        return ids[lower_bound(cdf.begin(), cdf.end(), u)-cdf.begin()];
+    }
+private:
+    vector<long> ids;
+    vector<double> cdf;
+};
+
+void write_features(ostream &out, const int nr_fields, const int nnz,
+        PowerLaw &feature, mt19937_64 &engine)
+{
+    uniform_real_distribution<double> value(0, 1);
+    for(int fi = 0; fi < nr_fields; fi++)
+        for(int t = 0; t < nnz; t++)
+            out << ' ' << fi << ':' << feature(engine) << ':' << value(engine);
+}
+
+void write_users(const string &path, const long nr_users, const Option &option,
+        PowerLaw &item, PowerLaw &feature, mt19937_64 &engine)
+{
+    ofstream out(path);
+    if(!out.is_open())
+        throw invalid_argument("cannot open " + path);
+    out.precision(3);
+    out << fixed;
+    geometric_distribution<long> nr_pos(1/option.pos);
+    vector<long> labels;
+    for(long i = 0; i < nr_users; i++)
+    {
+        labels.resize(1+nr_pos(engine));
+        for(long &j : labels)
+            j = item(engine);
+        sort(labels.begin(), labels.end());
+        labels.erase(unique(labels.begin(), labels.end()), labels.end());
+        for(size_t t = 0; t < labels.size(); t++)
+            out << ((t > 0)? ",": "") << labels[t];
+        write_features(out, option.fu, option.nnz, feature, engine);
+        out << '\n';
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        const Option option = parse_option(argc, argv);
+        mt19937_64 engine(option.seed);
+        PowerLaw item(option.n, option.alpha, engine);
+        PowerLaw feature(option.d, option.alpha, engine);
+
+        ofstream out(option.dir + "/item.ffm");
+        if(!out.is_open())
+            throw invalid_argument("cannot open " + option.dir + "/item.ffm");
+        for(long j = 0; j < option.n; j++)
+        {
+            ostringstream line;
+            line.precision(3);
+            line << fixed;
+            write_features(line, option.fv, option.nnz, feature, engine);
+            const string features = line.str();
+            out << features.substr(min<size_t>(1, features.size())) << '\n';
+        }
+
+        write_users(option.dir + "/tr.ffm", option.m, option, item, feature, engine);
+        write_users(option.dir + "/va.ffm", option.m_va, option, item, feature, engine);
+    }
+    catch(invalid_argument &e)
+    {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
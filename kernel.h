@@ -0,0 +1,348 @@
+#ifndef _IMP_KERNEL_H
+#define _IMP_KERNEL_H
+
+#include <immintrin.h>
+#include <cstdint>
+#include <cmath>
+
+// Dense kernels on latent rows, used instead of BLAS level-1 calls whose
+// call overhead dominates at length k. dot() always sums in double; axpy()
+// adds in the precision of y. dot_k/axpy_k switch once on k so the common
+// ranks get a fully unrolled body, and other lengths take the generic loop.
+
+#define IMP_INLINE inline __attribute__((always_inline))
+
+#if defined(__AVX2__) && defined(__FMA__) || defined(__AVX512F__)
+IMP_INLINE double hsum(const __m256d v) {
+    __m128d lo = _mm256_castpd256_pd128(v);
+    const __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+IMP_INLINE float hsum(const __m256 v) {
+    __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+    return _mm_cvtss_f32(_mm_add_ss(lo, _mm_movehdup_ps(lo)));
+}
+#endif
+
+#if defined(__AVX512F__)
+IMP_INLINE __m512d cvt_pd(const __m256 v) {
+    return _mm512_maskz_cvtps_pd(0xff, v);
+}
+
+IMP_INLINE double hsum(const __m512d v) {
+    const __m512d hi = _mm512_maskz_shuffle_f64x2(0xff, v, v, 0xee);
+    return hsum(_mm512_maskz_extractf64x4_pd(0xf, _mm512_add_pd(v, hi), 0));
+}
+
+IMP_INLINE float hsum(const __m512 v) {
+    const __m512 hi = _mm512_maskz_shuffle_f32x4(0xffff, v, v, 0xee);
+    const __m512d lo = _mm512_castps_pd(_mm512_add_ps(v, hi));
+    return hsum(_mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xf, lo, 0)));
+}
+#endif
+
+IMP_INLINE double dot(const double *p, const double *q, const long len) {
+    long i = 0;
+    double s = 0;
+#if defined(__AVX512F__)
+    __m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+    for (; i+16 <= len; i += 16) {
+        acc0 = _mm512_fmadd_pd(_mm512_loadu_pd(p+i), _mm512_loadu_pd(q+i), acc0);
+        acc1 = _mm512_fmadd_pd(_mm512_loadu_pd(p+i+8), _mm512_loadu_pd(q+i+8), acc1);
+    }
+    for (; i+8 <= len; i += 8)
+        acc0 = _mm512_fmadd_pd(_mm512_loadu_pd(p+i), _mm512_loadu_pd(q+i), acc0);
+    if (i < len) {
+        const __mmask8 mask = (1u << (len-i)) - 1;
+        acc1 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, p+i),
+                _mm512_maskz_loadu_pd(mask, q+i), acc1);
+        i = len;
+    }
+    s = hsum(_mm512_add_pd(acc0, acc1));
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    for (; i+8 <= len; i += 8) {
+        acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(p+i), _mm256_loadu_pd(q+i), acc0);
+        acc1 = _mm256_fmadd_pd(_mm256_loadu_pd(p+i+4), _mm256_loadu_pd(q+i+4), acc1);
+    }
+    for (; i+4 <= len; i += 4)
+        acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(p+i), _mm256_loadu_pd(q+i), acc0);
+    s = hsum(_mm256_add_pd(acc0, acc1));
+#endif
+    for (; i < len; i++)
+        s += p[i]*q[i];
+    return s;
+}
+
+IMP_INLINE double dot(const float *p, const float *q, const long len) {
+    long i = 0;
+    double s = 0;
+#if defined(__AVX512F__)
+    __m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+    for (; i+16 <= len; i += 16) {
+        acc0 = _mm512_fmadd_pd(cvt_pd(_mm256_loadu_ps(p+i)),
+                cvt_pd(_mm256_loadu_ps(q+i)), acc0);
+        acc1 = _mm512_fmadd_pd(cvt_pd(_mm256_loadu_ps(p+i+8)),
+                cvt_pd(_mm256_loadu_ps(q+i+8)), acc1);
+    }
+    for (; i+8 <= len; i += 8)
+        acc0 = _mm512_fmadd_pd(cvt_pd(_mm256_loadu_ps(p+i)),
+                cvt_pd(_mm256_loadu_ps(q+i)), acc0);
+    s = hsum(_mm512_add_pd(acc0, acc1));
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    for (; i+8 <= len; i += 8) {
+        acc0 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(p+i)),
+                _mm256_cvtps_pd(_mm_loadu_ps(q+i)), acc0);
+        acc1 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(p+i+4)),
+                _mm256_cvtps_pd(_mm_loadu_ps(q+i+4)), acc1);
+    }
+    for (; i+4 <= len; i += 4)
+        acc0 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(p+i)),
+                _mm256_cvtps_pd(_mm_loadu_ps(q+i)), acc0);
+    s = hsum(_mm256_add_pd(acc0, acc1));
+#endif
+    for (; i < len; i++)
+        s += double(p[i])*q[i];
+    return s;
+}
+
+IMP_INLINE void axpy_kernel(const double *x, double *y, const long len, const double a) {
+    long i = 0;
+#if defined(__AVX512F__)
+    const __m512d va = _mm512_set1_pd(a);
+    for (; i+8 <= len; i += 8)
+        _mm512_storeu_pd(y+i, _mm512_fmadd_pd(va, _mm512_loadu_pd(x+i), _mm512_loadu_pd(y+i)));
+    if (i < len) {
+        const __mmask8 mask = (1u << (len-i)) - 1;
+        _mm512_mask_storeu_pd(y+i, mask, _mm512_fmadd_pd(va,
+                    _mm512_maskz_loadu_pd(mask, x+i), _mm512_maskz_loadu_pd(mask, y+i)));
+        i = len;
+    }
+#elif defined(__AVX2__) && defined(__FMA__)
+    const __m256d va = _mm256_set1_pd(a);
+    for (const long n4 = len & ~3L; i < n4; i += 4)
+        _mm256_storeu_pd(y+i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i)));
+#endif
+    for (; i < len; i++)
+        y[i] += a*x[i];
+}
+
+IMP_INLINE void axpy_kernel(const float *x, float *y, const long len, const double a) {
+    long i = 0;
+#if defined(__AVX512F__)
+    const __m512 va = _mm512_set1_ps(a);
+    for (; i+16 <= len; i += 16)
+        _mm512_storeu_ps(y+i, _mm512_fmadd_ps(va, _mm512_loadu_ps(x+i), _mm512_loadu_ps(y+i)));
+    if (i < len) {
+        const __mmask16 mask = (1u << (len-i)) - 1;
+        _mm512_mask_storeu_ps(y+i, mask, _mm512_fmadd_ps(va,
+                    _mm512_maskz_loadu_ps(mask, x+i), _mm512_maskz_loadu_ps(mask, y+i)));
+        i = len;
+    }
+#elif defined(__AVX2__) && defined(__FMA__)
+    const __m256 va = _mm256_set1_ps(a);
+    for (const long n8 = len & ~7L; i < n8; i += 8)
+        _mm256_storeu_ps(y+i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x+i), _mm256_loadu_ps(y+i)));
+#endif
+    const float af = a;
+    for (; i < len; i++)
+        y[i] += af*x[i];
+}
+
+// Single-precision rows added into double accumulators.
+IMP_INLINE void axpy_kernel(const float *x, double *y, const long len, const double a) {
+    for (long i = 0; i < len; i++)
+        y[i] += a*x[i];
+}
+
+template <typename T>
+IMP_INLINE double dot_k(const T *p, const T *q, const long k) {
+    switch (k) {
+        case 4: return dot(p, q, 4);
+        case 8: return dot(p, q, 8);
+        case 16: return dot(p, q, 16);
+        case 32: return dot(p, q, 32);
+        case 64: return dot(p, q, 64);
+        default: return dot(p, q, k);
+    }
+}
+
+template <typename T, typename U>
+IMP_INLINE void axpy_k(const T *x, U *y, const long k, const double a) {
+    switch (k) {
+        case 4: axpy_kernel(x, y, 4, a); break;
+        case 8: axpy_kernel(x, y, 8, a); break;
+        case 16: axpy_kernel(x, y, 16, a); break;
+        case 32: axpy_kernel(x, y, 32, a); break;
+        case 64: axpy_kernel(x, y, 64, a); break;
+        default: axpy_kernel(x, y, k, a);
+    }
+}
+
+// Quantized rows. Half is an IEEE fp16 value, converted with F16C when the
+// target has it; int8 rows need no type of their own.
+struct Half {
+    uint16_t bits;
+};
+
+IMP_INLINE float half_to_float(const uint16_t h) {
+#if defined(__F16C__)
+    return _cvtsh_ss(h);
+#else
+    const int e = (h >> 10) & 0x1f, man = h & 0x3ff;
+    const float a = (e == 0)? ldexpf(man, -24):
+        (e == 31)? ((man == 0)? INFINITY: NAN): ldexpf(man+1024, e-25);
+    return (h & 0x8000)? -a: a;
+#endif
+}
+
+// Rounds to the nearest fp16 value, ties to even.
+IMP_INLINE uint16_t float_to_half(const float x) {
+#if defined(__F16C__)
+    return _cvtss_sh(x, _MM_FROUND_TO_NEAREST_INT);
+#else
+    const uint16_t sign = std::signbit(x)? 0x8000: 0;
+    const float a = fabsf(x);
+    if (std::isnan(a))
+        return sign | 0x7e00;
+    if (a >= 65520.f)
+        return sign | 0x7c00;
+    if (a < 6.103515625e-05f)
+        return sign | uint16_t(lrintf(a*16777216.f));
+    int e;
+    const float m = frexpf(a, &e);
+    return sign | uint16_t(((e+14) << 10) + lrintf((2*m-1)*1024));
+#endif
+}
+
+IMP_INLINE void half_to_float(const Half *h, float *x, const long len) {
+    long i = 0;
+#if defined(__AVX512F__)
+    for (; i+16 <= len; i += 16)
+        _mm512_storeu_ps(x+i, _mm512_maskz_cvtph_ps(0xffff, _mm256_loadu_si256((const __m256i*)(h+i))));
+#elif defined(__F16C__)
+    for (; i+8 <= len; i += 8)
+        _mm256_storeu_ps(x+i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(h+i))));
+#endif
+    for (; i < len; i++)
+        x[i] = half_to_float(h[i].bits);
+}
+
+// p . q for a float row p and a quantized row q, summed in float; the
+// caller applies q's scale.
+IMP_INLINE float dot_q(const float *p, const int8_t *q, const long len) {
+    long i = 0;
+    float s = 0;
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_setzero_ps();
+    for (; i+16 <= len; i += 16)
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(p+i), _mm512_maskz_cvtepi32_ps(0xffff,
+                    _mm512_maskz_cvtepi8_epi32(0xffff, _mm_loadu_si128((const __m128i*)(q+i)))), acc);
+    s = hsum(acc);
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i+8 <= len; i += 8)
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(p+i), _mm256_cvtepi32_ps(
+                    _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(q+i)))), acc);
+    s = hsum(acc);
+#endif
+    for (; i < len; i++)
+        s += p[i]*q[i];
+    return s;
+}
+
+IMP_INLINE float dot_q(const float *p, const Half *q, const long len) {
+    long i = 0;
+    float s = 0;
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_setzero_ps();
+    for (; i+16 <= len; i += 16)
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(p+i),
+                _mm512_maskz_cvtph_ps(0xffff, _mm256_loadu_si256((const __m256i*)(q+i))), acc);
+    s = hsum(acc);
+#elif defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i+8 <= len; i += 8)
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(p+i),
+                _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(q+i))), acc);
+    s = hsum(acc);
+#endif
+    for (; i < len; i++)
+        s += p[i]*half_to_float(q[i].bits);
+    return s;
+}
+
+// The rows gather_kernel multiplies: used in place, or fp16 rows widened
+// into a float buffer first.
+template <typename T>
+struct RowLoad {
+    template <long K>
+    static IMP_INLINE const T* get(const T *a, float *) { return a; }
+};
+
+template <>
+struct RowLoad<Half> {
+    template <long K>
+    static IMP_INLINE const float* get(const Half *a, float *buf) {
+        half_to_float(a, buf, K);
+        return buf;
+    }
+};
+
+// Sparse rows times dense rows: c += sum over s in [s0, s1) of
+// val(s)*A[idx[s]*stride ..], K wide. The sum stays in double registers
+// for the whole row and is added to c once; the rows of A a few nonzeros
+// ahead are prefetched, since idx makes them random reads.
+#define IMP_PREFETCH 8
+
+template <long K, typename I, typename F, typename T, typename U>
+IMP_INLINE void gather_kernel(const I *idx, const F &val, const long s0, const long s1,
+        const T *A, const long stride, U *c) {
+    double acc[K];
+    float buf[K];
+    for (long d = 0; d < K; d++)
+        acc[d] = 0;
+    for (long s = s0; s < s1; s++) {
+        if (s+IMP_PREFETCH < s1) {
+            const char *pf = (const char*)(A+idx[s+IMP_PREFETCH]*stride);
+            for (long l = 0; l < long(K*sizeof(T)); l += 64)
+                __builtin_prefetch(pf+l);
+        }
+        const double v = val(s);
+        const auto *a = RowLoad<T>::template get<K>(A+idx[s]*stride, buf);
+        for (long d = 0; d < K; d++)
+            acc[d] += v*a[d];
+    }
+    for (long d = 0; d < K; d++)
+        c[d] += acc[d];
+}
+
+// Other lengths go 16 columns at a time, and the rest one by one.
+template <typename I, typename F, typename T, typename U>
+IMP_INLINE void gather_loop(const I *idx, const F &val, const long s0, const long s1,
+        const T *A, U *c, const long k) {
+    long d0 = 0;
+    for (; d0+16 <= k; d0 += 16)
+        gather_kernel<16>(idx, val, s0, s1, A+d0, k, c+d0);
+    for (; d0 < k; d0++)
+        gather_kernel<1>(idx, val, s0, s1, A+d0, k, c+d0);
+}
+
+template <typename I, typename F, typename T, typename U>
+IMP_INLINE void gather_k(const I *idx, const F &val, const long s0, const long s1,
+        const T *A, U *c, const long k) {
+    switch (k) {
+        case 4: gather_kernel<4>(idx, val, s0, s1, A, 4, c); break;
+        case 8: gather_kernel<8>(idx, val, s0, s1, A, 8, c); break;
+        case 16: gather_kernel<16>(idx, val, s0, s1, A, 16, c); break;
+        case 32: gather_kernel<32>(idx, val, s0, s1, A, 32, c); break;
+        case 64: gather_kernel<64>(idx, val, s0, s1, A, 64, c); break;
+        default: gather_loop(idx, val, s0, s1, A, c, k);
+    }
+}
+
+#endif
@@ -0,0 +1,191 @@
+#include <iostream>
+#include <cstring>
+#include <stdexcept>
+
+#include "ffm.h"
+
+struct Option {
+    shared_ptr<Parameter> param;
+    string model_path, xt_path, user_path, output_path;
+    ImpInt top_n = 10;
+    ImpLong batch_size = 4096;
+    ImpInt nr_lists = 0, nr_probe = 0;
+    string export_path;
+};
+
+string predict_help()
+{
+    return string(
+    "usage: predict [options] model_file item_feature_file user_file output_file\n"
+    "\n"
+    "options:\n"
+    "-c <threads>: set number of cores\n"
+    "-n <top>: set number of items recommended to each user (default 10)\n"
+    "-b <users>: set number of users scored per batch (default 4096)\n"
+    "--ivf <lists>: retrieve from an approximate index of this many item lists\n"
+    "    instead of scoring every item (default 0: exact)\n"
+    "--probe <lists>: set lists scored per user with --ivf; more is slower\n"
+    "    and closer to exact (default lists/16, at least 1)\n"
+    "--export-items <path>: write one line per item holding its vector for\n"
+    "    inner product retrieval: the Q rows of every cross field pair, then\n"
+    "    the item self-side term\n"
+    "\n"
+    "model_file may be a text, binary or quantized model. user_file may be -\n"
+    "to read users from stdin; each output line lists item:score pairs of the\n"
+    "top items for the matching input line.\n"
+    );
+}
+
+Option parse_option(int argc, char **argv)
+{
+    vector<string> args;
+    for(int i = 0; i < argc; i++)
+        args.push_back(string(argv[i]));
+
+    if(argc == 1)
+        throw invalid_argument(predict_help());
+
+    Option option;
+    option.param = make_shared<Parameter>();
+    int i = 0;
+    for(i = 1; i < argc; i++)
+    {
+        if(args[i].compare("-c") == 0)
+        {
+            if((i+1) >= argc)
+                throw invalid_argument("missing core numbers after -c");
+            i++;
+            if(!is_numerical(argv[i]))
+                throw invalid_argument("-c should be followed by a number");
+            option.param->nr_threads = atoi(argv[i]);
+        }
+        else if(args[i].compare("-n") == 0)
+        {
+            if((i+1) >= argc)
+                throw invalid_argument("need to specify number of items after -n");
+            i++;
+            if(!is_numerical(argv[i]))
+                throw invalid_argument("-n should be followed by a number");
+            option.top_n = atoi(argv[i]);
+        }
+        else if(args[i].compare("-b") == 0)
+        {
+            if((i+1) >= argc)
+                throw invalid_argument("need to specify batch size after -b");
+            i++;
+            if(!is_numerical(argv[i]))
+                throw invalid_argument("-b should be followed by a number");
+            option.batch_size = max(1, atoi(argv[i]));
+        }
+        else if(args[i].compare("--ivf") == 0 || args[i].compare("--probe") == 0)
+        {
+            if((i+1) >= argc)
+                throw invalid_argument("need to specify number of lists after " + args[i]);
+            i++;
+            if(!is_numerical(argv[i]) || atoi(argv[i]) <= 0)
+                throw invalid_argument(args[i-1] + " should be followed by a positive number");
+            if(args[i-1].compare("--ivf") == 0)
+                option.nr_lists = atoi(argv[i]);
+            else
+                option.nr_probe = atoi(argv[i]);
+        }
+        else if(args[i].compare("--export-items") == 0)
+        {
+            if((i+1) >= argc)
+                throw invalid_argument("need to specify path after --export-items");
+            i++;
+            option.export_path = string(args[i]);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if(option.nr_probe > 0 && option.nr_lists == 0)
+        throw invalid_argument("--probe needs --ivf");
+    if(option.nr_probe == 0)
+        option.nr_probe = max(1u, option.nr_lists/16);
+
+    if(i+4 != argc)
+        throw invalid_argument(predict_help());
+
+    option.model_path = string(args[i++]);
+    option.xt_path = string(args[i++]);
+    option.user_path = string(args[i++]);
+    option.output_path = string(args[i++]);
+
+    return option;
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        Option option = parse_option(argc, argv);
+        omp_set_num_threads(option.param->nr_threads);
+
+        shared_ptr<ImpData> U = make_shared<ImpData>("");
+        shared_ptr<ImpData> Ut = make_shared<ImpData>("");
+        shared_ptr<ImpData> V = make_shared<ImpData>(option.xt_path);
+
+        ImpProblem prob(U, Ut, V, option.param);
+        load_model(prob, option.model_path);
+
+        const vector<ImpLong> item_ds = V->Ds;
+        V->read(false, option.param->nr_threads);
+        V->split_fields(item_ds);
+        prob.init_predict();
+        if(!option.export_path.empty())
+            prob.export_items(option.export_path);
+        if(option.nr_lists > 0)
+            prob.build_index(option.nr_lists, option.nr_probe);
+
+        ifstream user_file;
+        if(option.user_path != "-")
+        {
+            user_file.open(option.user_path);
+            if(!user_file.is_open())
+                throw invalid_argument("cannot open " + option.user_path);
+        }
+        istream &in = (option.user_path == "-")? cin: user_file;
+        ofstream out(option.output_path);
+        if(!out.is_open())
+            throw invalid_argument("cannot open " + option.output_path);
+
+        string buf;
+        vector<ImpLong> items;
+        Vec scores;
+        bool has_label = false;
+        for(ImpLong batch = 0; read_batch(in, option.batch_size, buf); batch++)
+        {
+            if(batch == 0)
+                has_label = has_label_block(buf);
+
+            shared_ptr<ImpData> Ub = make_shared<ImpData>("");
+            Ub->hash_bits = U->hash_bits;
+            Ub->parse(buf.data(), buf.data()+buf.size(), has_label, option.param->nr_threads);
+            Ub->split_fields(U->Ds);
+
+            prob.predict(Ub, option.top_n, items, scores);
+
+            const ImpLong nr_top = (Ub->m > 0)? items.size()/Ub->m: 0;
+            for(ImpLong i = 0; i < Ub->m; i++)
+            {
+                for(ImpLong t = 0; t < nr_top; t++)
+                {
+                    if(t > 0)
+                        out << ' ';
+                    out << items[i*nr_top+t] << ':' << scores[i*nr_top+t];
+                }
+                out << '\n';
+            }
+        }
+    }
+    catch (invalid_argument &e)
+    {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,181 @@
+#include <iostream>
+#include <cstring>
+#include <stdexcept>
+
+#include "ffm.h"
+
+// Writes a model with int8 or fp16 rows for serving, then ranks the items
+// for the labeled users of a validation file with the full and the
+// quantized model, so the drop in p@K and nDCG@K can be checked before the
+// quantized model ships.
+struct Option {
+    shared_ptr<Parameter> param;
+    string model_path, xt_path, va_path, output_path;
+    ImpLong bytes = QUANT_INT8;
+    ImpLong batch_size = 4096;
+};
+
+string quantize_help()
+{
+    return string(
+    "usage: quantize [options] model_file item_feature_file va_file output_file\n"
+    "\n"
+    "options:\n"
+    "-c <threads>: set number of cores\n"
+    "--fp16: store fp16 values instead of int8\n"
+    "-b <users>: set number of users scored per batch (default 4096)\n"
+    "--top-k <k,k,...>: set the K list of p@K and nDCG@K (default 5,10,20,40,80)\n"
+    "\n"
+    "output_file is a binary model that predict loads like any other; va_file\n"
+    "holds labeled users in the training format.\n"
+    );
+}
+
+Option parse_option(int argc, char **argv)
+{
+    vector<string> args;
+    for(int i = 0; i < argc; i++)
+        args.push_back(string(argv[i]));
+
+    if(argc == 1)
+        throw invalid_argument(quantize_help());
+
+    Option option;
+    option.param = make_shared<Parameter>();
+    int i = 0;
+    for(i = 1; i < argc; i++)
+    {
+        if(args[i].compare("-c") == 0)
+        {
+            if((i+1) >= argc)
+                throw invalid_argument("missing core numbers after -c");
+            i++;
+            if(!is_numerical(argv[i]))
+                throw invalid_argument("-c should be followed by a number");
+            option.param->nr_threads = atoi(argv[i]);
+        }
+        else if(args[i].compare("-b") == 0)
+        {
+            if((i+1) >= argc)
+                throw invalid_argument("need to specify batch size after -b");
+            i++;
+            if(!is_numerical(argv[i]))
+                throw invalid_argument("-b should be followed by a number");
+            option.batch_size = max(1, atoi(argv[i]));
+        }
+        else if(args[i].compare("--fp16") == 0)
+        {
+            option.bytes = QUANT_FP16;
+        }
+        else if(args[i].compare("--top-k") == 0)
+        {
+            if((i+1) >= argc)
+                throw invalid_argument("need to specify a list after --top-k");
+            i++;
+
+            option.param->top_k = parse_top_k(args[i]);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if(i+4 != argc)
+        throw invalid_argument(quantize_help());
+
+    option.model_path = string(args[i++]);
+    option.xt_path = string(args[i++]);
+    option.va_path = string(args[i++]);
+    option.output_path = string(args[i++]);
+
+    return option;
+}
+
+ImpDouble file_mb(const string &path)
+{
+    ifstream f(path, ios::binary | ios::ate);
+    return ImpDouble(f.tellg())/(1<<20);
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        Option option = parse_option(argc, argv);
+        omp_set_num_threads(option.param->nr_threads);
+        shared_ptr<Parameter> &param = option.param;
+
+        shared_ptr<ImpData> U = make_shared<ImpData>("");
+        shared_ptr<ImpData> Ut = make_shared<ImpData>("");
+        shared_ptr<ImpData> V = make_shared<ImpData>(option.xt_path);
+
+        ImpProblem full(U, Ut, V, param);
+        load_model(full, option.model_path);
+        const vector<ImpLong> item_ds = V->Ds;
+        V->read(false, param->nr_threads);
+        V->split_fields(item_ds);
+        full.init_predict();
+        full.save_quantized_model(option.output_path, option.bytes);
+
+        // The quantized model has the same fields, so it shares U and V.
+        ImpProblem quant(U, Ut, V, param);
+        load_model(quant, option.output_path);
+        quant.init_predict();
+
+        ifstream va_file(option.va_path);
+        if(!va_file.is_open())
+            throw invalid_argument("cannot open " + option.va_path);
+
+        const ImpInt nr_k = param->top_k.size();
+        vector<ImpLong> hits_full(nr_k, 0), hits_quant(nr_k, 0);
+        vector<ImpDouble> dcg_full(nr_k, 0), dcg_quant(nr_k, 0);
+        ImpLong nr_users = 0;
+        ImpDouble time_full = 0, time_quant = 0;
+        string buf;
+        for(ImpLong batch = 0; read_batch(va_file, option.batch_size, buf); batch++)
+        {
+            if(batch == 0 && !has_label_block(buf))
+                throw invalid_argument(option.va_path + " has no labels");
+
+            shared_ptr<ImpData> Ub = make_shared<ImpData>("");
+            Ub->hash_bits = U->hash_bits;
+            Ub->parse(buf.data(), buf.data()+buf.size(), true, param->nr_threads);
+            Ub->split_fields(U->Ds);
+
+            ImpDouble t0 = omp_get_wtime();
+            nr_users += full.evaluate(Ub, hits_full, dcg_full);
+            time_full += omp_get_wtime()-t0;
+            t0 = omp_get_wtime();
+            quant.evaluate(Ub, hits_quant, dcg_quant);
+            time_quant += omp_get_wtime()-t0;
+        }
+        if(nr_users == 0)
+            throw invalid_argument(option.va_path + " has no labeled users");
+
+        const string kind = (option.bytes == QUANT_INT8)? "int8": "fp16";
+        cout << fixed << setprecision(2);
+        cout << "model: " << file_mb(option.model_path) << " MB, " << kind << ": "
+            << file_mb(option.output_path) << " MB" << endl;
+        cout << "scoring " << nr_users << " users: " << time_full << " s, " << kind << ": "
+            << time_quant << " s" << endl;
+        cout << setprecision(5);
+        cout << setw(6) << "K" << setw(10) << "p@K" << setw(10) << kind << setw(10) << "drop"
+            << setw(10) << "nDCG@K" << setw(10) << kind << setw(10) << "drop" << endl;
+        for(ImpInt s = 0; s < nr_k; s++)
+        {
+            const ImpDouble p_full = ImpDouble(hits_full[s])/(nr_users*param->top_k[s]);
+            const ImpDouble p_quant = ImpDouble(hits_quant[s])/(nr_users*param->top_k[s]);
+            const ImpDouble n_full = dcg_full[s]/nr_users, n_quant = dcg_quant[s]/nr_users;
+            cout << setw(6) << param->top_k[s] << setw(10) << p_full << setw(10) << p_quant
+                << setw(10) << p_full-p_quant << setw(10) << n_full << setw(10) << n_quant
+                << setw(10) << n_full-n_quant << endl;
+        }
+    }
+    catch (invalid_argument &e)
+    {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
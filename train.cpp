@@ -6,7 +6,9 @@
 
 struct Option {
     shared_ptr<Parameter> param;
-    string xc_path, xt_path, tr_path, te_path, model_path;
+    string xc_path, xt_path, tr_path, te_path, model_path, cache_path;
+    bool binary_model = false;
+    vector<ImpInt> user_hash, item_hash;
 };
 
 string basename(string path) {
@@ -19,18 +21,6 @@ string basename(string path) {
 }
 
 
-bool is_numerical(char *str)
-{
-    int c = 0;
-    while(*str != '\0')
-    {
-        if(isdigit(*str))
-            c++;
-        str++;
-    }
-    return c > 0;
-}
-
 string train_help()
 {
     return string(
@@ -41,15 +31,50 @@ string train_help()
     "-t <iter>: set number of iterations (default 20)\n"
     "-p <path>: set path to test set\n"
     "-o <path>: set path to save model file\n"
+    "--binary: save the model in the binary format\n"
     "-w <omega>: set cost weight for the negatives\n"
     "-r <rating>: set rating for the negatives\n"
     "-c <threads>: set number of cores\n"
     "-k <rank>: set number of rank\n"
     "--no-item: set item-bias\n"
     "--freq: enable freq-aware lambda\n"
+    "--jacobi: solve all field blocks of a half-epoch concurrently and merge them by line search\n"
+    "--obj: print the training objective after every iteration\n"
+    "--cache <path>: load data from binary cache, or build it from text on a miss\n"
+    "--ooc <dir>: keep user rows, residuals and projections in scratch files under dir\n"
+    "--checkpoint <path>: save the model to path in the background during training\n"
+    "--checkpoint-every <iter>: set iterations between checkpoints (default 1)\n"
+    "--resume: continue from the checkpoint if it exists\n"
+    "--warm-start <path>: start from the weights of an earlier model\n"
+    "--fold-in: with --warm-start, train only the rows of features the model has not seen\n"
+    "--telemetry <path>: write per-kernel and per-block solver metrics as JSON lines\n"
+    "--eval-every <iter>: validate every iter iterations (default 10)\n"
+    "--va-sample <users>: validate on a fixed random sample of the test users\n"
+    "--top-k <k,k,...>: set the K list of p@K and nDCG@K (default 5,10,20,40,80)\n"
+    "--early-stop <metric>: stop when p@K, ndcg@K or ploss stops improving, and keep the best model\n"
+    "--patience <evals>: set validations without improvement before stopping (default 3)\n"
+    "--cg-eps <eps>: set relative tolerance of the conjugate gradient (default 0.09)\n"
+    "--max-cg <iter>: set conjugate gradient iterations per block (default 20)\n"
+    "--precond: precondition the conjugate gradient by the Hessian diagonal plus a shift\n"
+    "--precond-shift <s>: add s times the mean diagonal before inverting it (default 1e4, where the\n"
+    "    final objective and p@K match plain CG); smaller shifts descend faster but can overfit (see README)\n"
+    "--cg-warm: start the conjugate gradient from the last step of each block\n"
+    "--numa: pin threads, spread large arrays over NUMA nodes and back them with huge pages\n"
+    "--hash-bits <u|i><field>:<bits>,...: hash the indices of these user (u) or item (i) fields\n"
+    "    into 2^bits rows each, e.g. u0:20,i1:18; the model keeps the bits for prediction\n"
     );
 }
 
+// Field ids only get their bounds once the data is read.
+void check_hash_fields(const vector<ImpInt> &hash, const char side, const ImpLong f)
+{
+    for(ImpLong fi = f; fi < ImpLong(hash.size()); fi++)
+        if(hash[fi] > 0)
+            throw invalid_argument("--hash-bits field " + string(1, side) + to_string(fi) +
+                " is out of range; the data has " + to_string(f) +
+                ((side == 'u')? " user": " item") + " fields");
+}
+
 Option parse_option(int argc, char **argv)
 {
     vector<string> args;
@@ -151,58 +176,283 @@ Option parse_option(int argc, char **argv)
         else if(args[i].compare("--freq") == 0){
             option.param->freq = true;
         }
+        else if(args[i].compare("--jacobi") == 0){
+            option.param->jacobi = true;
+        }
+        else if(args[i].compare("--obj") == 0){
+            option.param->show_obj = true;
+        }
+        else if(args[i].compare("--binary") == 0)
+        {
+            option.binary_model = true;
+        }
+        else if(args[i].compare("--ooc") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify directory after --ooc");
+            i++;
+
+            option.param->ooc_path = string(args[i]);
+        }
+        else if(args[i].compare("--checkpoint") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after --checkpoint");
+            i++;
+
+            option.param->checkpoint_path = string(args[i]);
+        }
+        else if(args[i].compare("--checkpoint-every") == 0)
+        {
+            if((i+1) >= argc)
+                throw invalid_argument("need to specify iterations after --checkpoint-every");
+            i++;
+
+            if(!is_numerical(argv[i]) || atoi(argv[i]) <= 0)
+                throw invalid_argument("--checkpoint-every should be followed by a positive number");
+            option.param->checkpoint_every = atoi(argv[i]);
+        }
+        else if(args[i].compare("--resume") == 0)
+        {
+            option.param->resume = true;
+        }
+        else if(args[i].compare("--telemetry") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after --telemetry");
+            i++;
+
+            option.param->telemetry_path = string(args[i]);
+        }
+        else if(args[i].compare("--eval-every") == 0 || args[i].compare("--patience") == 0
+                || args[i].compare("--va-sample") == 0)
+        {
+            if((i+1) >= argc)
+                throw invalid_argument("need to specify a number after " + args[i]);
+            i++;
+
+            if(!is_numerical(argv[i]) || atol(argv[i]) <= 0)
+                throw invalid_argument(args[i-1] + " should be followed by a positive number");
+            if(args[i-1].compare("--eval-every") == 0)
+                option.param->eval_every = atoi(argv[i]);
+            else if(args[i-1].compare("--patience") == 0)
+                option.param->patience = atoi(argv[i]);
+            else
+                option.param->va_sample = atol(argv[i]);
+        }
+        else if(args[i].compare("--top-k") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify a list after --top-k");
+            i++;
+
+            option.param->top_k = parse_top_k(args[i]);
+        }
+        else if(args[i].compare("--hash-bits") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify fields after --hash-bits");
+            i++;
+
+            istringstream list(args[i]);
+            string item;
+            while(getline(list, item, ','))
+            {
+                const size_t colon = item.find(':');
+                if(item.size() < 4 || (item[0] != 'u' && item[0] != 'i') || colon == string::npos
+                        || colon == 1 || item.find_first_not_of("0123456789", 1) != colon
+                        || item.find_first_not_of("0123456789", colon+1) != string::npos)
+                    throw invalid_argument("--hash-bits should be followed by u<field>:<bits> or i<field>:<bits> items");
+                const ImpInt fid = atoi(item.c_str()+1), bits = atoi(item.c_str()+colon+1);
+                if(bits < 1 || bits > 32)
+                    throw invalid_argument("hash bits should be from 1 to 32");
+                vector<ImpInt> &hash = (item[0] == 'u')? option.user_hash: option.item_hash;
+                if(hash.size() <= fid)
+                    hash.resize(fid+1, 0);
+                hash[fid] = bits;
+            }
+        }
+        else if(args[i].compare("--early-stop") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify a metric after --early-stop");
+            i++;
+
+            option.param->early_stop = string(args[i]);
+        }
+        else if(args[i].compare("--cg-eps") == 0)
+        {
+            if((i+1) >= argc)
+                throw invalid_argument("need to specify tolerance after --cg-eps");
+            i++;
+
+            if(!is_numerical(argv[i]) || atof(argv[i]) <= 0)
+                throw invalid_argument("--cg-eps should be followed by a positive number");
+            option.param->cg_eps = atof(argv[i]);
+        }
+        else if(args[i].compare("--max-cg") == 0)
+        {
+            if((i+1) >= argc)
+                throw invalid_argument("need to specify iterations after --max-cg");
+            i++;
+
+            if(!is_numerical(argv[i]) || atoi(argv[i]) <= 0)
+                throw invalid_argument("--max-cg should be followed by a positive number");
+            option.param->max_cg = atoi(argv[i]);
+        }
+        else if(args[i].compare("--precond") == 0)
+        {
+            option.param->cg_precond = true;
+        }
+        else if(args[i].compare("--precond-shift") == 0)
+        {
+            if((i+1) >= argc)
+                throw invalid_argument("need to specify shift after --precond-shift");
+            i++;
+
+            if(!is_numerical(argv[i]))
+                throw invalid_argument("--precond-shift should be followed by a non-negative number");
+            option.param->precond_shift = atof(argv[i]);
+        }
+        else if(args[i].compare("--cg-warm") == 0)
+        {
+            option.param->cg_warm = true;
+        }
+        else if(args[i].compare("--numa") == 0)
+        {
+            option.param->numa = true;
+        }
+        else if(args[i].compare("--fold-in") == 0)
+        {
+            option.param->fold_in = true;
+        }
+        else if(args[i].compare("--warm-start") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after --warm-start");
+            i++;
+
+            option.param->warm_path = string(args[i]);
+        }
+        else if(args[i].compare("--cache") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after --cache");
+            i++;
+
+            option.cache_path = string(args[i]);
+        }
         else
         {
             break;
         }
     }
 
+    if(option.param->resume && option.param->checkpoint_path.empty())
+        throw invalid_argument("--resume needs --checkpoint");
+    if(option.param->fold_in && (option.param->warm_path.empty() || option.param->resume))
+        throw invalid_argument("--fold-in needs --warm-start and cannot resume");
+
     if(i >= argc)
         throw invalid_argument("training data not specified");
 
     option.xt_path = string(args[i++]);
     option.tr_path = string(args[i++]);
 
+    if(!option.param->early_stop.empty() && option.te_path.empty())
+        throw invalid_argument("--early-stop needs a test set given by -p");
+
     return option;
 }
 
 int main(int argc, char *argv[])
 {
+#ifdef USEMPI
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+#endif
+    // Users are split over MPI ranks; only rank 0 reports and saves.
+    const ImpInt rank = mpi_rank(), nr_ranks = mpi_size();
+    if (rank != 0)
+        cout.setstate(ios::failbit);
+
     try
     {
         Option option = parse_option(argc, argv);
         omp_set_num_threads(option.param->nr_threads);
-
+        if (option.param->numa) {
+            set_numa(true);
+            pin_threads();
+        }
 
         shared_ptr<ImpData> U = make_shared<ImpData>(option.tr_path);
         shared_ptr<ImpData> V = make_shared<ImpData>(option.xt_path);
 
         shared_ptr<ImpData> Ut = make_shared<ImpData>(option.te_path);
+        U->hash_bits = Ut->hash_bits = option.user_hash;
+        V->hash_bits = option.item_hash;
+
+        vector<shared_ptr<ImpData>> sets = {U, V};
+        if (!Ut->file_name.empty())
+            sets.push_back(Ut);
+
+        string cache_path = option.cache_path;
+        if (!cache_path.empty() && nr_ranks > 1)
+            cache_path += "." + to_string(rank) + "-" + to_string(nr_ranks);
 
+        vector<shared_ptr<ImpData>> mapped = sets;
+        ImpLong cached = !cache_path.empty() && load_cache(cache_path, mapped);
+        min_all(&cached, 1);
+        if (cached) {
+            U = mapped[0];
+            V = mapped[1];
+            if (!Ut->file_name.empty())
+                Ut = mapped[2];
+        }
+        else {
+            const ImpInt nr_threads = option.param->nr_threads;
+            thread read_u([&] { U->read(true, nr_threads, rank, nr_ranks); });
+            thread read_v([&] { V->read(false, nr_threads); });
+            if (!Ut->file_name.empty())
+                Ut->read(true, nr_threads, rank, nr_ranks);
+            read_u.join();
+            read_v.join();
 
-        U->read(true);
-        U->split_fields();
+            U->split_fields();
 
-        V->read(false);
-        V->transY(U->Y);
-        V->split_fields();
+            V->transY(U->Y);
+            V->split_fields();
 
-        if (!Ut->file_name.empty()) {
-            Ut->read(true, U->Ds.data());
-            Ut->split_fields();
+            if (!Ut->file_name.empty())
+                Ut->split_fields(U->Ds);
         }
 
+        check_hash_fields(option.user_hash, 'u', U->f);
+        check_hash_fields(option.item_hash, 'i', V->f);
+        if (!cached && !cache_path.empty())
+            save_cache(cache_path, sets);
+
         ImpProblem prob(U, Ut, V, option.param);
         prob.init();
         prob.solve();
-        if( !option.model_path.empty() )
-          save_model( prob , option.model_path );
+        if( !option.model_path.empty() && rank == 0 ) {
+            if( option.binary_model )
+                prob.save_binary_model( option.model_path );
+            else
+                save_model( prob , option.model_path );
+        }
     }
     catch (invalid_argument &e)
     {
         cerr << e.what() << endl;
+#ifdef USEMPI
+        MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
         return 1;
     }
+#ifdef USEMPI
+    MPI_Finalize();
+#endif
     return 0;
 }
 